@@ -2,19 +2,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <time.h>
-#include <utime.h>
 #include <getopt.h>
 #include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "crc32c.h"
+#include "iobatch.h"
+#include "lz.h"
 
 #define NAME_LIMIT 256
-#define COPY_BUF 4096
+#define MEMBER_NAME_MAX 4096
+#define ADD_BUF (1024 * 1024)
+#define BIG_BUF (1024 * 1024)
+#define ZC_CHUNK (1024 * 1024 * 1024)
+#define ZC_MIN_SIZE (256 * 1024)
+#define VERIFY_CHUNK (8 * 1024 * 1024)
 #define MAX_EXTRACT_SIZE (1024LL * 1024LL * 1024LL)
+#define BATCH_FILES 256
+#define BATCH_BYTES (8 * 1024 * 1024)
+#define BATCH_DEPTH 64
+#define BATCH_MIN_THREADS 4
+
+#define DEFAULT_COMPACT_THRESHOLD 0.5
+
+#define ARCHIVE_VERSION 4
+#define ARCHIVE_MAGIC "\0ARCHV\r\n"
+#define INDEX_MAGIC "ARCIDX\r\n"
+#define REC_MAGIC 0xA4
+
+#define CODEC_NONE 0
+#define CODEC_LZ   1
+#define LZ_RAW_BLOCK 0x80000000u
 
+#define HDR_HAS_CRC 0x1
+#define HDR_DEDUP   0x2
+#define HDR_HARDLINK 0x4
+
+/* Record header of the original format, stored as the raw struct. */
 struct fileInput {
     char  name[NAME_LIMIT];
     mode_t mode;
@@ -26,21 +62,162 @@ struct fileInput {
     char deleted;
 };
 
+/*
+ * In-memory form of a member header, whatever its layout on disk.
+ *
+ * Version 4 records start with a variable-length, little-endian header:
+ *
+ *   u8 REC_MAGIC, u8 deleted, varint body_len, body:
+ *     varint name_len, name bytes, varint mode, uid, gid, size, stored,
+ *     zigzag varint atime, mtime, varint codec, flags, u32 crc,
+ *     [varint data_off], [varint link_len, link bytes]
+ *
+ * With HDR_DEDUP the record has no payload of its own: it shares the
+ * `stored` bytes at absolute offset `data_off` with an earlier member
+ * (data_off is 0 for members that carry their payload). HDR_HARDLINK marks
+ * a hard link to the earlier member `link`. Directories have no payload,
+ * a symlink's payload is its target.
+ *
+ * Varints are LEB128. Decoders skip body bytes they do not know, so new
+ * fields can be appended. A CODEC_LZ payload is a sequence of blocks, each
+ * prefixed by a 32-bit little-endian length (LZ_RAW_BLOCK set if stored
+ * uncompressed).
+ */
+struct memberHeader {
+    char     name[MEMBER_NAME_MAX];
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t  size;
+    int64_t  stored;
+    int64_t  atime;
+    int64_t  mtime;
+    uint32_t codec;
+    uint32_t flags;
+    uint32_t crc;
+    int64_t  data_off;
+    uint8_t  deleted;
+    char     link[MEMBER_NAME_MAX];
+};
+
+#define HEADER_MAX (2 * MEMBER_NAME_MAX + 96)
+#define HEADER_PEEK 512
+
+/* On disk: magic, then version and a reserved word as u32 LE. */
+struct archiveHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+#define ARCHIVE_HEADER_SIZE 16
+
+/*
+ * Archive layout (version 4):
+ *
+ *   [archiveHeader] [member header][payload] ...
+ *       [indexEntry x count][names][indexTrailer]
+ *
+ * The index entries are sorted by name (ties broken by header offset) and
+ * refer to their names through offsets into the names block. Archives
+ * without a trailer are scanned header by header.
+ *
+ * Index entries, trailer and archive header are stored field by field in
+ * little-endian at the offsets given next to each field, whatever the
+ * host's byte order and struct padding; the structs are only their
+ * in-memory form. Entries take `entry_size` bytes each; fields that end
+ * beyond it, as in indexes written before they existed, read as 0.
+ *
+ * Version 1 (the original format) has only [fileInput][payload] records.
+ * Such archives are read, extracted and compacted, but only written to
+ * by compaction, which rewrites them as version 4.
+ */
+struct indexEntry {
+    int64_t  hdr_off;       /* 0 */
+    int64_t  size;          /* 8 */
+    int64_t  mtime;         /* 16 */
+    uint32_t name_off;      /* 24 */
+    uint16_t name_len;      /* 28 */
+    uint8_t  deleted;       /* 30 */
+    uint8_t  codec;         /* 31 */
+    int64_t  stored;        /* 32 */
+    uint32_t hdr_len;       /* 40 */
+    uint32_t crc;           /* 44 */
+    uint32_t flags;         /* 48 */
+    uint32_t mode;          /* 52 */
+    int64_t  data_off;      /* 56 */
+};
+
+#define INDEX_ENTRY_SIZE 64
+/* entry size of the first version 4 indexes, which ended at `flags` */
+#define INDEX_ENTRY_MIN 56
+
+struct indexTrailer {
+    int64_t  index_off;     /* 0 */
+    uint64_t count;         /* 8 */
+    uint64_t names_len;     /* 16 */
+    uint32_t version;       /* 24 */
+    uint32_t entry_size;    /* 28 */
+    char     magic[8];      /* 32 */
+};
+
+#define INDEX_TRAILER_SIZE 40
+
+struct archIndex {
+    struct indexEntry *ent;
+    size_t count;
+    size_t cap;
+    char  *names;
+    size_t names_len;
+    size_t names_cap;
+    int    version;
+    off_t  data_start;
+    off_t  data_end;
+    off_t  index_off;
+    size_t entry_size;
+    const unsigned char *map;
+    size_t map_len;
+};
+
 static void print_usage(const char *prog) {
     printf("Usage: %s <archive> [option] [file]\n", prog);
     printf("Options:\n");
-    printf("  -i, --input <file>    Add file to archive\n");
-    printf("  -e, --extract <file>  Extract file from archive (and remove it)\n");
+    printf("  -i, --input <file>    Add file to archive (may be repeated)\n");
+    printf("  -T, --files-from <list>\n");
+    printf("                        Add files named in <list>, one per line ('-' = stdin)\n");
+    printf("  -r, --recursive <dir> Add a directory tree with its subdirectories,\n");
+    printf("                        symlinks and hard links (may be repeated)\n");
+    printf("  -z, --compress        Compress added files with the built-in LZ codec\n");
+    printf("  -D, --dedup           Store files whose content is already archived\n");
+    printf("                        as references to the existing copy\n");
+    printf("  -e, --extract <file>  Extract file from archive (and remove it; may be repeated)\n");
+    printf("  -x, --extract-all     Extract every file from the archive\n");
+    printf("  -j, --jobs <n>        Worker threads for extract/verify (default: CPU count)\n");
+    printf("  -I, --io <engine>     Open, read and write small files in batches on\n");
+    printf("                        'uring' (io_uring, falls back to threads when\n");
+    printf("                        unavailable) or 'threads' (add, extract)\n");
+    printf("  -m, --mmap            Read the archive through a memory mapping\n");
+    printf("                        (stat, extract, verify)\n");
+    printf("  -C, --cat <file>      Write a member's contents to standard output\n");
+    printf("  -o, --offset <n>      With --cat: start at byte <n> of the member\n");
+    printf("  -l, --length <n>      With --cat: write at most <n> bytes\n");
     printf("  -s, --stat            Show archive contents\n");
+    printf("  -V, --verify          Check headers and checksums of all members\n");
+    printf("  -c, --compact         Drop removed members and rewrite the archive\n");
+    printf("  -t, --compact-threshold <fraction>\n");
+    printf("                        Compact after extract once dead bytes exceed\n");
+    printf("                        this share of the archive (default %.2f)\n",
+           DEFAULT_COMPACT_THRESHOLD);
     printf("  -h, --help            Show this help message\n");
 }
 
-static int full_write(int fd, const void *buf, size_t len, const char *msg) {
+static int full_pwrite(int fd, const void *buf, size_t len, off_t off,
+                       const char *msg) {
     const char *p = buf;
     size_t left = len;
 
     while (left > 0) {
-        ssize_t w = write(fd, p, left);
+        ssize_t w = pwrite(fd, p, left, off);
         if (w < 0) {
             perror(msg);
             return -1;
@@ -50,329 +227,3289 @@ static int full_write(int fd, const void *buf, size_t len, const char *msg) {
             return -1;
         }
         p += w;
+        off += w;
         left -= (size_t)w;
     }
     return 0;
 }
 
-static int skip_bytes(int fd, off_t size) {
-    char buf[COPY_BUF];
-
-    if (size <= 0) return 0;
-
-    if (lseek(fd, size, SEEK_CUR) != (off_t)-1) {
-        return 0;
-    }
+static int full_pread(int fd, void *buf, size_t len, off_t off,
+                      const char *msg) {
+    char *p = buf;
+    size_t left = len;
 
-    off_t left = size;
     while (left > 0) {
-        ssize_t chunk = (left > (off_t)sizeof(buf)) ? sizeof(buf) : left;
-        ssize_t r = read(fd, buf, chunk);
+        ssize_t r = pread(fd, p, left, off);
         if (r < 0) {
-            perror("skip_bytes: read");
+            perror(msg);
             return -1;
         }
         if (r == 0) {
-            fprintf(stderr, "skip_bytes: unexpected EOF\n");
+            fprintf(stderr, "%s: unexpected EOF\n", msg);
             return -1;
         }
-        left -= r;
+        p += r;
+        off += r;
+        left -= (size_t)r;
     }
     return 0;
 }
 
-static int cmd_add(const char *archive_name, const char *file_name) {
-    int arch_fd = open(archive_name, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (arch_fd < 0) {
-        perror("Failed to open/create archive");
-        return -1;
-    }
+/* For streams without offsets, such as standard output. */
+static int full_write(int fd, const void *buf, size_t len, const char *msg) {
+    const char *p = buf;
 
-    int in_fd = open(file_name, O_RDONLY);
-    if (in_fd < 0) {
-        perror("Failed to open input file");
-        close(arch_fd);
-        return -1;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror(msg);
+            return -1;
+        }
+        p += w;
+        len -= (size_t)w;
     }
+    return 0;
+}
 
-    struct stat st;
-    if (fstat(in_fd, &st) < 0) {
-        perror("Failed to stat input file");
-        close(in_fd);
-        close(arch_fd);
-        return -1;
+/* Like full_pread, but a short read at EOF is not an error. */
+static ssize_t pread_some(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t r = pread(fd, p + got, len - got, off + (off_t)got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
     }
+    return (ssize_t)got;
+}
 
-    if (!S_ISREG(st.st_mode)) {
-        fprintf(stderr, "Error: '%s' is not a regular file\n", file_name);
-        close(in_fd);
-        close(arch_fd);
-        return -1;
+/*
+ * Opens the archive under an advisory lock: LOCK_SH for readers, LOCK_EX
+ * for anything that writes, so concurrent adds, extracts and compactions
+ * take turns. Compaction replaces the archive by rename while holding the
+ * lock, so once a waiter gets it, the fd must still be the file at `name`;
+ * if it is not, the new file is opened and locked instead.
+ */
+static int archive_open(const char *name, int flags, int lock) {
+    while (1) {
+        int fd = open(name, flags, 0666);
+        if (fd < 0) return -1;
+
+        int r;
+        while ((r = flock(fd, lock)) < 0 && errno == EINTR)
+            ;
+        struct stat cur, now;
+        if (r == 0 && fstat(fd, &cur) == 0 && stat(name, &now) == 0 &&
+            cur.st_dev == now.st_dev && cur.st_ino == now.st_ino)
+            return fd;
+
+        int err = errno;
+        close(fd);
+        if (r < 0) {
+            errno = err;
+            return -1;
+        }
+        /* replaced or removed while we waited */
     }
-    struct fileInput hdr = {0};
-    if (strlen(file_name) >= NAME_LIMIT) {
-        fprintf(stderr, "Error: file name '%s' is too long\n", file_name);
-        close(in_fd);
-        close(arch_fd);
-        return -1;
+}
+
+static size_t varint_len(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
     }
-    strncpy(hdr.name, file_name, NAME_LIMIT - 1);
-    hdr.mode = st.st_mode;
-    hdr.uid = st.st_uid;
-    hdr.gid = st.st_gid;
-    hdr.size = st.st_size;
-    hdr.atime = st.st_atime;
-    hdr.mtime = st.st_mtime;
-    hdr.deleted = 0;
-    if (full_write(arch_fd, &hdr, sizeof(hdr), "Failed to write header") < 0) {
-        close(in_fd);
-        close(arch_fd);
-        return -1;
+    return n;
+}
+
+/*
+ * Writes `v` as LEB128. With a nonzero `width` the encoding is padded with
+ * continuation bytes to that length, so a later value of at most the same
+ * width can be patched over it in place.
+ */
+static size_t varint_put(unsigned char *p, uint64_t v, size_t width) {
+    size_t n = 0;
+    while (v >= 0x80 || n + 1 < width) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
     }
+    p[n++] = (unsigned char)v;
+    return n;
+}
 
-    char buf[COPY_BUF];
-    ssize_t r;
-    while ((r = read(in_fd, buf, sizeof(buf))) > 0) {
-        if (full_write(arch_fd, buf, r, "Failed to write data") < 0) {
-            close(in_fd);
-            close(arch_fd);
-            return -1;
+static int varint_get(const unsigned char **p, const unsigned char *end,
+                      uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 70 && *p < end; shift += 7) {
+        unsigned char b = *(*p)++;
+        if (shift < 64) x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return 0;
         }
     }
+    return -1;
+}
 
-    if (r < 0) {
-        perror("Failed to read input file");
-        close(in_fd);
-        close(arch_fd);
-        return -1;
-    }
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
 
-    printf("File '%s' added to archive '%s'.\n", file_name, archive_name);
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
 
-    close(in_fd);
-    close(arch_fd);
-    return 0;
+static void le_put(unsigned char *p, uint64_t v, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
 }
-static int cmd_compact(const char *archive_name) {
-    int in_fd = open(archive_name, O_RDONLY);
-    if (in_fd < 0) {
-        perror("compact: cannot open archive");
-        return -1;
+
+static uint64_t le_get(const unsigned char *p, size_t n) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static void archive_header_encode(const struct archiveHeader *ah,
+                                  unsigned char *p) {
+    memcpy(p, ah->magic, sizeof(ah->magic));
+    le_put(p + 8, ah->version, 4);
+    le_put(p + 12, ah->reserved, 4);
+}
+
+static void archive_header_decode(const unsigned char *p,
+                                  struct archiveHeader *ah) {
+    memcpy(ah->magic, p, sizeof(ah->magic));
+    ah->version = (uint32_t)le_get(p + 8, 4);
+    ah->reserved = (uint32_t)le_get(p + 12, 4);
+}
+
+static void entry_encode(const struct indexEntry *e, unsigned char *p) {
+    le_put(p, (uint64_t)e->hdr_off, 8);
+    le_put(p + 8, (uint64_t)e->size, 8);
+    le_put(p + 16, (uint64_t)e->mtime, 8);
+    le_put(p + 24, e->name_off, 4);
+    le_put(p + 28, e->name_len, 2);
+    p[30] = e->deleted;
+    p[31] = e->codec;
+    le_put(p + 32, (uint64_t)e->stored, 8);
+    le_put(p + 40, e->hdr_len, 4);
+    le_put(p + 44, e->crc, 4);
+    le_put(p + 48, e->flags, 4);
+    le_put(p + 52, e->mode, 4);
+    le_put(p + 56, (uint64_t)e->data_off, 8);
+}
+
+/* Decodes an entry of `esz` bytes (at least INDEX_ENTRY_MIN). */
+static void entry_decode(const unsigned char *p, size_t esz,
+                         struct indexEntry *e) {
+    memset(e, 0, sizeof(*e));
+    e->hdr_off = (int64_t)le_get(p, 8);
+    e->size = (int64_t)le_get(p + 8, 8);
+    e->mtime = (int64_t)le_get(p + 16, 8);
+    e->name_off = (uint32_t)le_get(p + 24, 4);
+    e->name_len = (uint16_t)le_get(p + 28, 2);
+    e->deleted = p[30];
+    e->codec = p[31];
+    e->stored = (int64_t)le_get(p + 32, 8);
+    e->hdr_len = (uint32_t)le_get(p + 40, 4);
+    e->crc = (uint32_t)le_get(p + 44, 4);
+    e->flags = (uint32_t)le_get(p + 48, 4);
+    e->mode = (uint32_t)le_get(p + 52, 4);
+    if (esz >= 64) e->data_off = (int64_t)le_get(p + 56, 8);
+}
+
+static void trailer_encode(const struct indexTrailer *tr, unsigned char *p) {
+    le_put(p, (uint64_t)tr->index_off, 8);
+    le_put(p + 8, tr->count, 8);
+    le_put(p + 16, tr->names_len, 8);
+    le_put(p + 24, tr->version, 4);
+    le_put(p + 28, tr->entry_size, 4);
+    memcpy(p + 32, tr->magic, sizeof(tr->magic));
+}
+
+static void trailer_decode(const unsigned char *p, struct indexTrailer *tr) {
+    tr->index_off = (int64_t)le_get(p, 8);
+    tr->count = le_get(p + 8, 8);
+    tr->names_len = le_get(p + 16, 8);
+    tr->version = (uint32_t)le_get(p + 24, 4);
+    tr->entry_size = (uint32_t)le_get(p + 28, 4);
+    memcpy(tr->magic, p + 32, sizeof(tr->magic));
+}
+
+/*
+ * Encodes `h` as a version 4 record header and returns its length.
+ * `width` is the padded varint width of size and stored (0 = minimal).
+ */
+static size_t header_encode(const struct memberHeader *h, size_t width,
+                            unsigned char *buf) {
+    unsigned char body[HEADER_MAX];
+    size_t name_len = strnlen(h->name, MEMBER_NAME_MAX - 1);
+    size_t n = varint_put(body, name_len, 0);
+    memcpy(body + n, h->name, name_len);
+    n += name_len;
+    n += varint_put(body + n, h->mode, 0);
+    n += varint_put(body + n, h->uid, 0);
+    n += varint_put(body + n, h->gid, 0);
+    n += varint_put(body + n, (uint64_t)h->size, width);
+    n += varint_put(body + n, (uint64_t)h->stored, width);
+    n += varint_put(body + n, zigzag(h->atime), 0);
+    n += varint_put(body + n, zigzag(h->mtime), 0);
+    n += varint_put(body + n, h->codec, 0);
+    n += varint_put(body + n, h->flags, 0);
+    for (int i = 0; i < 4; i++) body[n++] = (unsigned char)(h->crc >> (8 * i));
+    if (h->flags & HDR_DEDUP) n += varint_put(body + n, (uint64_t)h->data_off, 0);
+    if (h->flags & HDR_HARDLINK) {
+        size_t link_len = strnlen(h->link, MEMBER_NAME_MAX - 1);
+        n += varint_put(body + n, link_len, 0);
+        memcpy(body + n, h->link, link_len);
+        n += link_len;
     }
 
-    char tmp_name[512];
-    snprintf(tmp_name, sizeof(tmp_name), "%s.tmpXXXXXX", archive_name);
+    buf[0] = REC_MAGIC;
+    buf[1] = h->deleted ? 1 : 0;
+    size_t len = 2 + varint_put(buf + 2, n, 0);
+    memcpy(buf + len, body, n);
+    return len + n;
+}
 
-    int tmp_fd = mkstemp(tmp_name);
-    if (tmp_fd < 0) {
-        perror("compact: cannot create temp file");
-        close(in_fd);
+/* Offset of the tombstone byte within a member header. */
+static off_t header_deleted_off(int version) {
+    return version < 4 ? (off_t)offsetof(struct fileInput, deleted) : 1;
+}
+
+/* Reads from the archive mapping when there is one, else with pread. */
+static ssize_t archive_read(const struct archIndex *idx, int fd, void *buf,
+                            size_t len, off_t off) {
+    if (!idx->map) return pread_some(fd, buf, len, off);
+    if (off < 0 || (size_t)off >= idx->map_len) return 0;
+    if (len > idx->map_len - (size_t)off) len = idx->map_len - (size_t)off;
+    memcpy(buf, idx->map + off, len);
+    return (ssize_t)len;
+}
+
+/*
+ * The mapped bytes [off, off + len), or NULL when there is no mapping or
+ * the range does not lie inside it, as with a truncated or corrupt
+ * archive. Callers then read with pread, which reports the short read.
+ */
+static const unsigned char *archive_mapped(const struct archIndex *idx,
+                                           off_t off, off_t len) {
+    if (!idx->map || off < 0 || len < 0 || (uint64_t)off > idx->map_len ||
+        (uint64_t)len > idx->map_len - (uint64_t)off)
+        return NULL;
+    return idx->map + off;
+}
+
+static void archive_advise(const struct archIndex *idx, off_t off, off_t len,
+                           int advice) {
+    if (!idx->map || len <= 0) return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)off & ~(page - 1);
+    madvise((void *)(idx->map + start), (size_t)(off + len) - start, advice);
+}
+
+static int header_decode_v4(const unsigned char *p, const unsigned char *end,
+                            struct memberHeader *h) {
+    uint64_t name_len, mode, uid, gid, size, stored, atime, mtime, codec, flags;
+
+    if (varint_get(&p, end, &name_len) < 0 || name_len >= MEMBER_NAME_MAX ||
+        name_len > (uint64_t)(end - p) || memchr(p, '\0', name_len))
+        return -1;
+    memcpy(h->name, p, name_len);
+    h->name[name_len] = '\0';
+    p += name_len;
+
+    if (varint_get(&p, end, &mode) < 0 || varint_get(&p, end, &uid) < 0 ||
+        varint_get(&p, end, &gid) < 0 || varint_get(&p, end, &size) < 0 ||
+        varint_get(&p, end, &stored) < 0 || varint_get(&p, end, &atime) < 0 ||
+        varint_get(&p, end, &mtime) < 0 || varint_get(&p, end, &codec) < 0 ||
+        varint_get(&p, end, &flags) < 0 || end - p < 4)
+        return -1;
+    if (mode > UINT32_MAX || uid > UINT32_MAX || gid > UINT32_MAX ||
+        size > INT64_MAX || stored > INT64_MAX || codec > UINT32_MAX ||
+        flags > UINT32_MAX)
         return -1;
+    h->mode = (uint32_t)mode;
+    h->uid = (uint32_t)uid;
+    h->gid = (uint32_t)gid;
+    h->size = (int64_t)size;
+    h->stored = (int64_t)stored;
+    h->atime = unzigzag(atime);
+    h->mtime = unzigzag(mtime);
+    h->codec = (uint32_t)codec;
+    h->flags = (uint32_t)flags;
+    h->crc = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+             (uint32_t)p[3] << 24;
+    p += 4;
+    if (h->flags & HDR_DEDUP) {
+        uint64_t data_off;
+        if (varint_get(&p, end, &data_off) < 0 || data_off == 0 ||
+            data_off > INT64_MAX)
+            return -1;
+        h->data_off = (int64_t)data_off;
+    }
+    if (h->flags & HDR_HARDLINK) {
+        uint64_t link_len;
+        if (varint_get(&p, end, &link_len) < 0 || link_len == 0 ||
+            link_len >= MEMBER_NAME_MAX || link_len > (uint64_t)(end - p) ||
+            memchr(p, '\0', link_len))
+            return -1;
+        memcpy(h->link, p, link_len);
+        h->link[link_len] = '\0';
+        p += link_len;
     }
+    /* anything after this was added by a newer writer */
+    return 0;
+}
 
-    struct stat st;
-    if (fstat(in_fd, &st) == 0) fchmod(tmp_fd, st.st_mode);
+/*
+ * Reads the member header at `off` in the record layout of the archive.
+ * Version 1 records are reported as uncompressed payloads without a
+ * checksum. Returns -2, without a message, if the header runs past the
+ * end of the archive.
+ */
+static int header_read(const struct archIndex *idx, int fd, off_t off,
+                       struct memberHeader *h, uint32_t *hdr_len) {
+    unsigned char buf[HEADER_MAX];
+    int version = idx->version;
+    size_t want = version >= 4 ? HEADER_PEEK : sizeof(struct fileInput);
 
-    struct fileInput hdr;
-    char buf[COPY_BUF];
+    memset(h, 0, sizeof(*h));
+    ssize_t got = archive_read(idx, fd, buf, want, off);
+    if (got < 0) {
+        perror("Failed to read header");
+        return -1;
+    }
 
-    while (1) {
-        ssize_t r = read(in_fd, &hdr, sizeof(hdr));
-        if (r == 0) break;
-        if (r < 0) {
-            perror("compact: read error");
-            goto fail;
+    if (version >= 4) {
+        const unsigned char *p = buf + 2, *end = buf + got;
+        uint64_t body_len;
+        int ok = got >= 2 && buf[0] == REC_MAGIC &&
+                 varint_get(&p, end, &body_len) == 0;
+        if (!ok && (size_t)got < want && (got == 0 || buf[0] == REC_MAGIC))
+            return -2;
+        if (!ok || body_len > HEADER_MAX - (size_t)(p - buf)) {
+            fprintf(stderr, "Broken archive: bad member header\n");
+            return -1;
         }
-        if (r != sizeof(hdr)) {
-            fprintf(stderr, "compact: partial header — broken archive\n");
-            goto fail;
+        size_t len = (size_t)(p - buf) + (size_t)body_len;
+        if (len > (size_t)got) {
+            /* long name: fetch the rest of the header */
+            if (archive_read(idx, fd, buf + got, len - (size_t)got,
+                             off + got) != (ssize_t)(len - (size_t)got))
+                return -2;
         }
-
-        if (hdr.deleted) {
-            if (skip_bytes(in_fd, hdr.size) < 0) goto fail;
-            continue;
+        if (header_decode_v4(p, buf + len, h) < 0) {
+            fprintf(stderr, "Broken archive: bad member header\n");
+            return -1;
         }
+        h->deleted = buf[1];
+        *hdr_len = (uint32_t)len;
+        return 0;
+    }
 
-        if (full_write(tmp_fd, &hdr, sizeof(hdr), "compact: write header") < 0)
-            goto fail;
+    struct fileInput fi;
+    if ((size_t)got < sizeof(fi)) return -2;
+    memcpy(&fi, buf, sizeof(fi));
+    memcpy(h->name, fi.name, NAME_LIMIT);
+    h->name[NAME_LIMIT - 1] = '\0';
+    h->mode = fi.mode;
+    h->uid = fi.uid;
+    h->gid = fi.gid;
+    h->size = fi.size;
+    h->atime = fi.atime;
+    h->mtime = fi.mtime;
+    h->deleted = (uint8_t)fi.deleted;
+    h->codec = CODEC_NONE;
+    h->stored = fi.size;
+    *hdr_len = sizeof(fi);
+    return 0;
+}
+
+/*
+ * Moves `len` bytes between two fds at explicit offsets, preferring
+ * in-kernel copies: copy_file_range (which can reflink), then sendfile,
+ * then a large-buffer pread/pwrite loop. Returns the number of bytes
+ * copied, which is short only if the input hits EOF, or -1 on error.
+ * Whether a call works depends on the pair of files, so a fallback only
+ * holds for the rest of this copy; it is local, as workers copy at once.
+ */
+static off_t copy_range(int in_fd, off_t in_off, int out_fd, off_t out_off,
+                        off_t len, const char *msg) {
+    int no_copy_file_range = 0, no_sendfile = 0;
+    char *buf = NULL;
+    off_t done = 0;
 
-        off_t left = hdr.size;
-        while (left > 0) {
-            ssize_t want = left > sizeof(buf) ? sizeof(buf) : left;
-            ssize_t br = read(in_fd, buf, want);
-            if (br <= 0) {
-                perror("compact: read data error");
+    while (done < len) {
+        size_t chunk = (len - done > ZC_CHUNK) ? ZC_CHUNK : (size_t)(len - done);
+        ssize_t n;
+
+        if (!no_copy_file_range) {
+            n = copy_file_range(in_fd, &in_off, out_fd, &out_off, chunk, 0);
+            if (n >= 0) goto advanced;
+            if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+                errno != EOPNOTSUPP && errno != EBADF) {
+                perror(msg);
+                goto fail;
+            }
+            no_copy_file_range = 1;
+        }
+        if (!no_sendfile) {
+            if (lseek(out_fd, out_off, SEEK_SET) == (off_t)-1) {
+                perror(msg);
                 goto fail;
             }
-            if (full_write(tmp_fd, buf, br, "compact: write data") < 0)
+            n = sendfile(out_fd, in_fd, &in_off, chunk);
+            if (n >= 0) {
+                out_off += n;
+                goto advanced;
+            }
+            if (errno != ENOSYS && errno != EINVAL) {
+                perror(msg);
                 goto fail;
-            left -= br;
+            }
+            no_sendfile = 1;
         }
-    }
-    fsync(tmp_fd);
-    close(tmp_fd);
-    close(in_fd);
 
-    if (rename(tmp_name, archive_name) < 0) {
-        perror("compact: rename failed");
-        unlink(tmp_name);
-        return -1;
+        if (!buf && !(buf = malloc(BIG_BUF))) {
+            perror(msg);
+            goto fail;
+        }
+        if (chunk > BIG_BUF) chunk = BIG_BUF;
+        n = pread(in_fd, buf, chunk, in_off);
+        if (n < 0) {
+            perror(msg);
+            goto fail;
+        }
+        if (n > 0 && full_pwrite(out_fd, buf, n, out_off, msg) < 0) goto fail;
+        in_off += n;
+        out_off += n;
+
+advanced:
+        if (n == 0) break;
+        done += n;
     }
-    return 0;
+    free(buf);
+    return done;
 
 fail:
-    close(tmp_fd);
-    close(in_fd);
-    unlink(tmp_name);
+    free(buf);
     return -1;
 }
 
-static int cmd_extract(const char *archive_name, const char *file_name) {
-    int arch_fd = open(archive_name, O_RDWR);
-    if (arch_fd < 0) {
-        perror("Failed to open archive");
+static int crc_range(int fd, off_t off, off_t len, uint32_t *crc,
+                     const char *msg) {
+    unsigned char *buf = malloc(BIG_BUF);
+    uint32_t c = *crc;
+
+    if (!buf) {
+        perror(msg);
         return -1;
     }
-    struct fileInput hdr;
-    int found = 0;
-
-    while (1) {
-        off_t hdr_pos = lseek(arch_fd, 0, SEEK_CUR);
-        if (hdr_pos == (off_t)-1) {
-            perror("lseek failed");
-            close(arch_fd);
+    while (len > 0) {
+        size_t want = len > BIG_BUF ? BIG_BUF : (size_t)len;
+        if (full_pread(fd, buf, want, off, msg) < 0) {
+            free(buf);
             return -1;
         }
+        c = crc32c(c, buf, want);
+        off += (off_t)want;
+        len -= (off_t)want;
+    }
+    free(buf);
+    *crc = c;
+    return 0;
+}
 
-        ssize_t r = read(arch_fd, &hdr, sizeof(hdr));
-        if (r == 0) break;
-        if (r < 0) {
-            perror("Failed to read header");
-            close(arch_fd);
+/*
+ * Compares `len` bytes of two files at explicit offsets. Returns 1 if they
+ * are equal, 0 if they differ or either side is short, -1 on error.
+ */
+static int range_equal(int fd_a, off_t off_a, int fd_b, off_t off_b,
+                       off_t len) {
+    unsigned char *a = malloc(2 * BIG_BUF), *b;
+    int eq = 1;
+
+    if (!a) {
+        perror("dedup: malloc");
+        return -1;
+    }
+    b = a + BIG_BUF;
+    while (len > 0 && eq) {
+        size_t want = len > BIG_BUF ? BIG_BUF : (size_t)len;
+        ssize_t ra = pread_some(fd_a, a, want, off_a);
+        ssize_t rb = pread_some(fd_b, b, want, off_b);
+        if (ra < 0 || rb < 0) {
+            perror("dedup: read");
+            free(a);
             return -1;
         }
-        if (r != sizeof(hdr)) {
-            fprintf(stderr, "Broken archive: partial header\n");
-            close(arch_fd);
+        eq = (size_t)ra == want && (size_t)rb == want && memcmp(a, b, want) == 0;
+        off_a += (off_t)want;
+        off_b += (off_t)want;
+        len -= (off_t)want;
+    }
+    free(a);
+    return eq;
+}
+
+/* Same as range_equal, with one side already in memory. */
+static int buf_equal(int fd, off_t off, const unsigned char *data, off_t len) {
+    unsigned char *buf = malloc(BIG_BUF);
+    int eq = 1;
+
+    if (!buf) {
+        perror("dedup: malloc");
+        return -1;
+    }
+    while (len > 0 && eq) {
+        size_t want = len > BIG_BUF ? BIG_BUF : (size_t)len;
+        ssize_t r = pread_some(fd, buf, want, off);
+        if (r < 0) {
+            perror("dedup: read");
+            free(buf);
             return -1;
         }
+        eq = (size_t)r == want && memcmp(buf, data, want) == 0;
+        data += want;
+        off += (off_t)want;
+        len -= (off_t)want;
+    }
+    free(buf);
+    return eq;
+}
 
-        if (!hdr.deleted && strcmp(hdr.name, file_name) == 0) {
-            found = 1;
-
-            if (hdr.size > MAX_EXTRACT_SIZE) {
-                fprintf(stderr, "File too large to extract: %lld bytes\n",
-                        (long long)hdr.size);
-                skip_bytes(arch_fd, hdr.size);
-                break;
-            }
+static void index_init(struct archIndex *idx) {
+    memset(idx, 0, sizeof(*idx));
+    idx->index_off = -1;
+}
 
-            int out_fd = open(hdr.name, O_WRONLY | O_CREAT | O_TRUNC, hdr.mode);
-            if (out_fd < 0) {
-                perror("Failed to create output file");
-                skip_bytes(arch_fd, hdr.size);
-                break;
-            }
-            char buf[COPY_BUF];
-            off_t left = hdr.size;
-            while (left > 0) {
-                ssize_t want = (left > sizeof(buf)) ? sizeof(buf) : left;
-                ssize_t br = read(arch_fd, buf, want);
-                if (br <= 0) {
-                    perror("Error reading archived data");
-                    close(out_fd);
-                    close(arch_fd);
-                    return -1;
-                }
-                if (full_write(out_fd, buf, br, "Error writing extracted file") < 0) {
-                    close(out_fd);
-                    close(arch_fd);
-                    return -1;
-                }
-                left -= br;
-            }
+static void index_free(struct archIndex *idx) {
+    free(idx->ent);
+    free(idx->names);
+    if (idx->map) munmap((void *)idx->map, idx->map_len);
+    index_init(idx);
+}
 
-            close(out_fd);
+static const char *entry_name(const struct archIndex *idx,
+                              const struct indexEntry *e) {
+    return idx->names + e->name_off;
+}
 
-            chmod(hdr.name, hdr.mode);
-            chown(hdr.name, hdr.uid, hdr.gid);
-            struct utimbuf times = {hdr.atime, hdr.mtime};
-            utime(hdr.name, &times);
-            hdr.deleted = 1;
-            lseek(arch_fd, hdr_pos, SEEK_SET);
-            full_write(arch_fd, &hdr, sizeof(hdr), "Failed to mark deleted");
+/* Archive offset of the member's payload, which may belong to another member. */
+static off_t entry_data(const struct indexEntry *e) {
+    return e->data_off ? e->data_off : e->hdr_off + (off_t)e->hdr_len;
+}
 
-            close(arch_fd);
+/* Payload bytes that follow the header on disk; references have none. */
+static off_t entry_inline(const struct indexEntry *e) {
+    return e->data_off ? 0 : e->stored;
+}
 
-            if (cmd_compact(archive_name) < 0) {
-                fprintf(stderr, "Warning: archive compaction failed.\n");
-            }
+static int index_push(struct archIndex *idx, off_t hdr_off, uint32_t hdr_len,
+                      const struct memberHeader *hdr) {
+    size_t len = strnlen(hdr->name, MEMBER_NAME_MAX);
 
-            printf("Extracted '%s'.\n", file_name);
-            return 0;
-        } else {
-            if (skip_bytes(arch_fd, hdr.size) < 0) {
-                close(arch_fd);
-                return -1;
-            }
+    if (idx->count == idx->cap) {
+        size_t cap = idx->cap ? idx->cap * 2 : 64;
+        struct indexEntry *ent = realloc(idx->ent, cap * sizeof(*ent));
+        if (!ent) {
+            perror("index: realloc");
+            return -1;
         }
+        idx->ent = ent;
+        idx->cap = cap;
     }
-
-    if (!found) {
-        printf("File '%s' not found in archive.\n", file_name);
+    if (idx->names_len + len + 1 > idx->names_cap) {
+        size_t cap = idx->names_cap ? idx->names_cap : 4096;
+        while (cap < idx->names_len + len + 1) cap *= 2;
+        char *names = realloc(idx->names, cap);
+        if (!names) {
+            perror("index: realloc");
+            return -1;
+        }
+        idx->names = names;
+        idx->names_cap = cap;
     }
 
-    close(arch_fd);
-    return found ? 0 : 1;
+    struct indexEntry *e = &idx->ent[idx->count++];
+    memset(e, 0, sizeof(*e));
+    e->hdr_off = hdr_off;
+    e->size = hdr->size;
+    e->mtime = hdr->mtime;
+    e->name_off = (uint32_t)idx->names_len;
+    e->name_len = (uint16_t)len;
+    e->deleted = hdr->deleted ? 1 : 0;
+    e->codec = (uint8_t)hdr->codec;
+    e->stored = hdr->stored;
+    e->hdr_len = hdr_len;
+    e->crc = hdr->crc;
+    e->flags = hdr->flags;
+    e->data_off = hdr->data_off;
+    e->mode = hdr->mode;
+
+    memcpy(idx->names + idx->names_len, hdr->name, len);
+    idx->names[idx->names_len + len] = '\0';
+    idx->names_len += len + 1;
+    return 0;
 }
 
-static int cmd_stat(const char *archive_name) {
-    int arch_fd = open(archive_name, O_RDONLY);
-    if (arch_fd < 0) {
-        perror("Failed to open archive");
-        return -1;
-    }
-    printf("Archive '%s' contents:\n", archive_name);
-    printf("----------------------------------------------\n");
-    printf("%-30s %-12s %-20s\n", "File name", "Size (B)", "Modified");
-    printf("----------------------------------------------\n");
-    struct fileInput hdr;
+static int entry_cmp_name(const void *a, const void *b, void *arg) {
+    const struct indexEntry *ea = a, *eb = b;
+    const char *names = arg;
+    int c = strcmp(names + ea->name_off, names + eb->name_off);
+    if (c) return c;
+    return (ea->hdr_off > eb->hdr_off) - (ea->hdr_off < eb->hdr_off);
+}
 
-    while (1) {
-        ssize_t r = read(arch_fd, &hdr, sizeof(hdr));
-        if (r == 0) break;
-        if (r < 0) {
-            perror("read error");
-            close(arch_fd);
+static int entry_cmp_off(const void *a, const void *b) {
+    const struct indexEntry *ea = a, *eb = b;
+    return (ea->hdr_off > eb->hdr_off) - (ea->hdr_off < eb->hdr_off);
+}
+
+static void index_sort(struct archIndex *idx) {
+    if (idx->count > 1)
+        qsort_r(idx->ent, idx->count, sizeof(*idx->ent), entry_cmp_name,
+                idx->names);
+}
+
+/* Fallback path: walk every header from the start of the archive. */
+static int index_scan(int fd, struct archIndex *idx, off_t size) {
+    struct archiveHeader ah;
+    unsigned char abuf[ARCHIVE_HEADER_SIZE];
+
+    idx->version = 1;
+    idx->data_start = 0;
+    if (size >= ARCHIVE_HEADER_SIZE) {
+        if (archive_read(idx, fd, abuf, sizeof(abuf), 0) != (ssize_t)sizeof(abuf)) {
+            perror("Failed to read archive");
             return -1;
         }
-        if (r != sizeof(hdr)) {
-            fprintf(stderr, "Broken archive: partial header\n");
-            close(arch_fd);
-            return -1;
+        archive_header_decode(abuf, &ah);
+        if (memcmp(ah.magic, ARCHIVE_MAGIC, sizeof(ah.magic)) == 0) {
+            if (ah.version != ARCHIVE_VERSION) {
+                fprintf(stderr, "Unsupported archive version %u\n", ah.version);
+                return -1;
+            }
+            idx->version = (int)ah.version;
+            idx->data_start = ARCHIVE_HEADER_SIZE;
         }
+    }
 
-        if (!hdr.deleted) {
-            char tbuf[64];
-            struct tm *tm = localtime(&hdr.mtime);
-            if (tm) strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm);
-            else strcpy(tbuf, "unknown");
-            printf("%-30s %-12lld %-20s\n",
-                   hdr.name, (long long)hdr.size, tbuf);
-        }
+    off_t pos = idx->data_start;
+    while (pos < size) {
+        struct memberHeader hdr;
+        uint32_t hdr_len;
 
-        if (skip_bytes(arch_fd, hdr.size) < 0) {
-            close(arch_fd);
+        /*
+         * A member that runs past the end of the file is what an
+         * interrupted append leaves behind. Everything before it is
+         * intact; the next add writes over the torn tail.
+         */
+        int r = header_read(idx, fd, pos, &hdr, &hdr_len);
+        off_t body = hdr.data_off ? 0 : hdr.stored;
+        if (r == -2 || (r == 0 && hdr.stored >= 0 &&
+                        body > size - pos - (off_t)hdr_len)) {
+            fprintf(stderr, "Warning: ignoring incomplete member at offset "
+                    "%lld (interrupted append?)\n", (long long)pos);
+            break;
+        }
+        if (r < 0) return -1;
+        if (hdr.stored < 0 ||
+            (hdr.data_off && (hdr.data_off < idx->data_start ||
+                              hdr.stored > pos - hdr.data_off))) {
+            fprintf(stderr, "Broken archive: bad member '%s'\n", hdr.name);
             return -1;
         }
+        if (index_push(idx, pos, hdr_len, &hdr) < 0) return -1;
+        pos += (off_t)hdr_len + body;
     }
-
-    close(arch_fd);
+    idx->data_end = pos;
+    idx->index_off = -1;
+    index_sort(idx);
     return 0;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
+/*
+ * With `use_map`, the archive is mapped read-only for the lifetime of the
+ * index and every later header and payload read goes through the mapping.
+ */
+static int index_load(int fd, struct archIndex *idx, int use_map) {
+    struct stat st;
+    struct indexTrailer tr;
+    unsigned char tbuf[INDEX_TRAILER_SIZE];
+
+    index_init(idx);
+    if (fstat(fd, &st) < 0) {
+        perror("Failed to stat archive");
+        return -1;
+    }
+    if (use_map && st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("Failed to map archive");
+            return -1;
+        }
+        idx->map = p;
+        idx->map_len = (size_t)st.st_size;
+    }
+    if (st.st_size >= INDEX_TRAILER_SIZE &&
+        archive_read(idx, fd, tbuf, sizeof(tbuf),
+                     st.st_size - INDEX_TRAILER_SIZE) == (ssize_t)sizeof(tbuf))
+        trailer_decode(tbuf, &tr);
+    else
+        memset(&tr, 0, sizeof(tr));
+    if (memcmp(tr.magic, INDEX_MAGIC, sizeof(tr.magic)) != 0) {
+        /* no index: the scan touches every header once, front to back */
+        archive_advise(idx, 0, st.st_size, MADV_SEQUENTIAL);
+        if (index_scan(fd, idx, st.st_size) < 0) {
+            index_free(idx);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (tr.version != ARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported archive version %u\n", tr.version);
+        index_free(idx);
+        return -1;
+    }
+    size_t esz = tr.entry_size;
+    if (esz < INDEX_ENTRY_MIN || tr.index_off < 0 ||
+        tr.count > (uint64_t)st.st_size / esz ||
+        (uint64_t)tr.index_off + tr.count * esz + tr.names_len +
+                INDEX_TRAILER_SIZE !=
+            (uint64_t)st.st_size) {
+        fprintf(stderr, "Broken archive: bad index trailer\n");
+        index_free(idx);
+        return -1;
+    }
+
+    size_t ent_len = tr.count * esz;
+    size_t blob_len = ent_len + tr.names_len;
+    char *blob = NULL;
+    const char *src;
+    if (idx->map) {
+        src = (const char *)idx->map + tr.index_off;
+    } else {
+        blob = malloc(blob_len ? blob_len : 1);
+        if (!blob) {
+            perror("index: malloc");
+            return -1;
+        }
+        if (full_pread(fd, blob, blob_len, tr.index_off,
+                       "Failed to read index") < 0) {
+            free(blob);
+            return -1;
+        }
+        src = blob;
+    }
+
+    idx->count = idx->cap = tr.count;
+    idx->ent = calloc(tr.count ? tr.count : 1, sizeof(*idx->ent));
+    idx->names_len = idx->names_cap = tr.names_len;
+    idx->names = malloc(tr.names_len ? tr.names_len : 1);
+    if (!idx->ent || !idx->names) {
+        perror("index: malloc");
+        free(blob);
+        index_free(idx);
+        return -1;
+    }
+    for (size_t i = 0; i < idx->count; i++)
+        entry_decode((const unsigned char *)src + i * esz, esz, &idx->ent[i]);
+    memcpy(idx->names, src + ent_len, tr.names_len);
+    free(blob);
+
+    for (size_t i = 0; i < idx->count; i++) {
+        const struct indexEntry *e = &idx->ent[i];
+        if ((uint64_t)e->name_off + e->name_len >= idx->names_len ||
+            idx->names[e->name_off + e->name_len] != '\0' ||
+            e->hdr_off < 0 || e->stored < 0 ||
+            e->hdr_off + (off_t)e->hdr_len + entry_inline(e) > tr.index_off ||
+            (e->data_off && (e->data_off < 0 ||
+                             e->stored > e->hdr_off - e->data_off))) {
+            fprintf(stderr, "Broken archive: bad index entry\n");
+            index_free(idx);
+            return -1;
+        }
+    }
+    idx->version = (int)tr.version;
+    idx->data_start = ARCHIVE_HEADER_SIZE;
+    idx->data_end = tr.index_off;
+    idx->index_off = tr.index_off;
+    idx->entry_size = esz;
+    return 0;
+}
+
+/* Writes the index at `off` and cuts the archive right after the trailer. */
+static int index_write(int fd, struct archIndex *idx, off_t off) {
+    struct indexTrailer tr;
+    size_t ent_len = idx->count * INDEX_ENTRY_SIZE;
+    size_t len = ent_len + idx->names_len + INDEX_TRAILER_SIZE;
+
+    index_sort(idx);
+
+    char *buf = malloc(len);
+    if (!buf) {
+        perror("index: malloc");
+        return -1;
+    }
+    memset(&tr, 0, sizeof(tr));
+    tr.index_off = off;
+    tr.count = idx->count;
+    tr.names_len = idx->names_len;
+    tr.version = (uint32_t)idx->version;
+    tr.entry_size = INDEX_ENTRY_SIZE;
+    memcpy(tr.magic, INDEX_MAGIC, sizeof(tr.magic));
+
+    for (size_t i = 0; i < idx->count; i++)
+        entry_encode(&idx->ent[i], (unsigned char *)buf + i * INDEX_ENTRY_SIZE);
+    memcpy(buf + ent_len, idx->names, idx->names_len);
+    trailer_encode(&tr, (unsigned char *)buf + ent_len + idx->names_len);
+
+    int rc = full_pwrite(fd, buf, len, off, "Failed to write index");
+    free(buf);
+    if (rc < 0) return -1;
+    if (ftruncate(fd, off + (off_t)len) < 0) {
+        perror("Failed to truncate archive");
+        return -1;
+    }
+    idx->data_end = off;
+    idx->index_off = off;
+    idx->entry_size = INDEX_ENTRY_SIZE;
+    return 0;
+}
+
+/*
+ * Returns the live member called `name`. Copies of a name are sorted by
+ * header offset, so when there are several the last one, the newest
+ * append, is the one returned, as --extract-all does.
+ */
+static struct indexEntry *index_find(struct archIndex *idx, const char *name) {
+    size_t lo = 0, hi = idx->count;
+    struct indexEntry *found = NULL;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(entry_name(idx, &idx->ent[mid]), name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < idx->count; lo++) {
+        struct indexEntry *e = &idx->ent[lo];
+        if (strcmp(entry_name(idx, e), name) != 0) break;
+        if (!e->deleted) found = e;
+    }
+    return found;
+}
+
+/*
+ * Sets the tombstone byte of a member, first in its entry of the index on
+ * disk (the commit record; entries there are in the loaded order), then
+ * in its header. A crash in between leaves the two disagreeing, so
+ * readers go by the index and only fall back on headers when scanning an
+ * archive without one.
+ */
+static int mark_deleted(const struct archIndex *idx, int fd,
+                        struct indexEntry *e) {
+    char one = 1;
+    if (idx->index_off >= 0) {
+        off_t at = idx->index_off +
+                   (off_t)((size_t)(e - idx->ent) * idx->entry_size) + 30;
+        if (full_pwrite(fd, &one, sizeof(one), at, "Failed to mark deleted") < 0)
+            return -1;
+    }
+    if (full_pwrite(fd, &one, sizeof(one),
+                    e->hdr_off + header_deleted_off(idx->version),
+                    "Failed to mark deleted") < 0)
+        return -1;
+    e->deleted = 1;
+    return 0;
+}
+
+/* Open-addressing hash map from nonzero 64-bit keys to 64-bit values. */
+struct hashMap {
+    uint64_t *keys;
+    uint64_t *vals;
+    size_t cap;
+    size_t count;
+};
+
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+static int hmap_get(const struct hashMap *m, uint64_t key, uint64_t *val) {
+    if (!m->cap) return 0;
+    for (size_t i = mix64(key) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (m->keys[i] == 0) return 0;
+        if (m->keys[i] == key) {
+            *val = m->vals[i];
+            return 1;
+        }
+    }
+}
+
+static int hmap_put(struct hashMap *m, uint64_t key, uint64_t val) {
+    if (2 * (m->count + 1) > m->cap) {
+        struct hashMap g = {0};
+        g.cap = m->cap ? m->cap * 2 : 256;
+        g.keys = calloc(g.cap, sizeof(*g.keys));
+        g.vals = malloc(g.cap * sizeof(*g.vals));
+        if (!g.keys || !g.vals) {
+            perror("hash map: malloc");
+            free(g.keys);
+            free(g.vals);
+            return -1;
+        }
+        for (size_t i = 0; i < m->cap; i++)
+            if (m->keys[i]) hmap_put(&g, m->keys[i], m->vals[i]);
+        free(m->keys);
+        free(m->vals);
+        *m = g;
+    }
+    size_t i = mix64(key) & (m->cap - 1);
+    while (m->keys[i] && m->keys[i] != key) i = (i + 1) & (m->cap - 1);
+    if (!m->keys[i]) m->count++;
+    m->keys[i] = key;
+    m->vals[i] = val;
+    return 0;
+}
+
+static void hmap_free(struct hashMap *m) {
+    free(m->keys);
+    free(m->vals);
+    memset(m, 0, sizeof(*m));
+}
+
+/*
+ * Bytes taken by live and tombstoned members, headers included. A removed
+ * member's payload still counts as live while another member shares it.
+ */
+static void index_usage(const struct archIndex *idx, off_t *live, off_t *dead) {
+    struct hashMap shared = {0};
+
+    for (size_t i = 0; i < idx->count; i++) {
+        const struct indexEntry *e = &idx->ent[i];
+        if (!e->deleted && e->data_off) hmap_put(&shared, (uint64_t)e->data_off, 1);
+    }
+    *live = *dead = 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        const struct indexEntry *e = &idx->ent[i];
+        off_t body = entry_inline(e);
+        uint64_t v;
+        if (!e->deleted) {
+            *live += (off_t)e->hdr_len + body;
+        } else if (body && hmap_get(&shared, (uint64_t)entry_data(e), &v)) {
+            *live += body;
+            *dead += (off_t)e->hdr_len;
+        } else {
+            *dead += (off_t)e->hdr_len + body;
+        }
+    }
+    hmap_free(&shared);
+}
+
+/*
+ * Append buffer for batch adds: headers and payloads of consecutive members
+ * are packed into one large buffer and written with a single pwrite.
+ */
+struct appendBuf {
+    char  *buf;
+    size_t len;
+    size_t cap;
+    off_t  base;
+    unsigned char *zraw;
+    unsigned char *zout;
+};
+
+static int abuf_flush(int fd, struct appendBuf *ab) {
+    if (ab->len == 0) return 0;
+    if (full_pwrite(fd, ab->buf, ab->len, ab->base,
+                    "Failed to write archive data") < 0)
+        return -1;
+    ab->base += (off_t)ab->len;
+    ab->len = 0;
+    return 0;
+}
+
+static int abuf_put(int fd, struct appendBuf *ab, const void *data,
+                    size_t len) {
+    if (ab->len + len > ab->cap && abuf_flush(fd, ab) < 0) return -1;
+    memcpy(ab->buf + ab->len, data, len);
+    ab->len += len;
+    return 0;
+}
+
+/* Overwrites bytes at archive offset `off`, wherever they currently live. */
+static int abuf_patch(int fd, struct appendBuf *ab, off_t off,
+                      const void *data, size_t len) {
+    if (off >= ab->base) {
+        memcpy(ab->buf + (off - ab->base), data, len);
+        return 0;
+    }
+    return full_pwrite(fd, data, len, off, "Failed to write header");
+}
+
+/*
+ * Dedup table lookups: members are keyed by size, codec and the CRC of
+ * their stored bytes, and a hit is only trusted after a byte comparison.
+ */
+static uint64_t dedup_key(off_t size, uint32_t codec, uint32_t crc) {
+    return mix64((uint64_t)size ^ mix64((uint64_t)crc << 8 | codec)) | 1;
+}
+
+static const struct indexEntry *dedup_find(const struct archIndex *idx,
+                                           const struct hashMap *dedup,
+                                           off_t size, uint32_t codec,
+                                           uint32_t crc) {
+    uint64_t i;
+    if (!hmap_get(dedup, dedup_key(size, codec, crc), &i)) return NULL;
+    const struct indexEntry *e = &idx->ent[i];
+    if (e->size != size || e->codec != codec || e->crc != crc ||
+        !(e->flags & HDR_HAS_CRC))
+        return NULL;
+    return e;
+}
+
+/* Appends `hdr` as a member sharing the payload of `src`. */
+static int add_ref(int arch_fd, struct appendBuf *ab, struct archIndex *idx,
+                   struct memberHeader *hdr, const struct indexEntry *src) {
+    unsigned char hbuf[HEADER_MAX];
+    off_t pos = ab->base + (off_t)ab->len;
+
+    hdr->size = src->size;
+    hdr->stored = src->stored;
+    hdr->codec = src->codec;
+    hdr->crc = src->crc;
+    hdr->flags |= HDR_HAS_CRC | HDR_DEDUP;
+    hdr->data_off = entry_data(src);
+    size_t len = header_encode(hdr, 0, hbuf);
+    if (abuf_put(arch_fd, ab, hbuf, len) < 0) return -1;
+    return index_push(idx, pos, (uint32_t)len, hdr);
+}
+
+static ssize_t read_block(int fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+/*
+ * Streams up to `limit` input bytes through the LZ codec one block at a
+ * time; blocks that do not shrink are stored raw. The input is `in_fd`,
+ * or `data` when the file was already read. Returns the stored payload
+ * length.
+ */
+static off_t add_compressed(int in_fd, const unsigned char *data,
+                            int arch_fd, struct appendBuf *ab, off_t limit,
+                            off_t *raw_len, uint32_t *crc) {
+    off_t stored = 0;
+
+    if (!ab->zraw) ab->zraw = malloc(LZ_BLOCK_SIZE);
+    if (!ab->zout) ab->zout = malloc(LZ_BOUND(LZ_BLOCK_SIZE));
+    if (!ab->zraw || !ab->zout) {
+        perror("add: malloc");
+        return -1;
+    }
+
+    while (*raw_len < limit) {
+        size_t want = LZ_BLOCK_SIZE;
+        if (limit - *raw_len < (off_t)want) want = (size_t)(limit - *raw_len);
+        const unsigned char *raw = data ? data + *raw_len : ab->zraw;
+        ssize_t n = data ? (ssize_t)want : read_block(in_fd, ab->zraw, want);
+        if (n < 0) {
+            perror("Failed to read input file");
+            return -1;
+        }
+        if (n == 0) break;
+
+        size_t c = lz_compress(raw, (size_t)n, ab->zout, (size_t)n - 1);
+        unsigned char blk[4];
+        le_put(blk, c ? (uint32_t)c : ((uint32_t)n | LZ_RAW_BLOCK), sizeof(blk));
+        const unsigned char *out = c ? ab->zout : raw;
+        size_t len = c ? c : (size_t)n;
+        if (abuf_put(arch_fd, ab, blk, sizeof(blk)) < 0 ||
+            abuf_put(arch_fd, ab, out, len) < 0)
+            return -1;
+        *crc = crc32c(*crc, blk, sizeof(blk));
+        *crc = crc32c(*crc, out, len);
+
+        stored += (off_t)sizeof(blk) + (off_t)(c ? c : (size_t)n);
+        *raw_len += n;
+        if ((size_t)n < want) break;
+    }
+    return stored;
+}
+
+/*
+ * The name `path` is stored and extracted under: leading '/' are dropped,
+ * as tar does, so that members always land below the current directory.
+ */
+static const char *member_name(const char *path) {
+    while (*path == '/') path++;
+    return path;
+}
+
+/* Whether `name` stays below the current directory: not empty, no "..". */
+static int member_name_safe(const char *name) {
+    name = member_name(name);
+    if (name[0] == '\0') return 0;
+    for (const char *p = name; *p;) {
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        if (*p) p++;
+    }
+    return 1;
+}
+
+static void close_input(int fd) {
+    if (fd >= 0) close(fd);
+}
+
+/*
+ * Appends the regular file open on `in_fd` (which it closes) as
+ * `file_name`; with `in_fd` = -1 the contents are the st_size bytes at
+ * `data` instead. With a `dedup` table, content already in the archive is
+ * stored as a reference instead: uncompressed files are hashed before
+ * anything is written, compressed ones are dropped again after encoding.
+ * Returns 1 for errors that only skip this file.
+ */
+static int add_file(int arch_fd, struct appendBuf *ab, struct archIndex *idx,
+                    int in_fd, const unsigned char *data,
+                    const struct stat *stp, const char *file_name,
+                    int codec, struct hashMap *dedup) {
+    const struct stat st = *stp;
+
+    if (strlen(file_name) >= MEMBER_NAME_MAX) {
+        fprintf(stderr, "Error: file name '%s' is too long\n", file_name);
+        close_input(in_fd);
+        return 1;
+    }
+
+    struct memberHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    strcpy(hdr.name, file_name);
+    hdr.mode = st.st_mode;
+    hdr.uid = st.st_uid;
+    hdr.gid = st.st_gid;
+    hdr.size = st.st_size;
+    hdr.atime = st.st_atime;
+    hdr.mtime = st.st_mtime;
+    hdr.codec = (uint32_t)codec;
+    hdr.stored = st.st_size;
+
+    if (dedup && codec == CODEC_NONE && st.st_size > 0) {
+        uint32_t crc = 0;
+        if (data) {
+            crc = crc32c(0, data, (size_t)st.st_size);
+        } else if (crc_range(in_fd, 0, st.st_size, &crc,
+                             "Failed to read input file") < 0) {
+            close_input(in_fd);
+            return 1;
+        }
+        const struct indexEntry *src = dedup_find(idx, dedup, st.st_size,
+                                                  CODEC_NONE, crc);
+        int eq = 0;
+        if (src && abuf_flush(arch_fd, ab) < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+        if (src)
+            eq = data ? buf_equal(arch_fd, entry_data(src), data, st.st_size)
+                      : range_equal(in_fd, 0, arch_fd, entry_data(src),
+                                    st.st_size);
+        if (eq < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+        if (eq) {
+            close_input(in_fd);
+            return add_ref(arch_fd, ab, idx, &hdr, src) < 0 ? -1 : 0;
+        }
+    }
+
+    /*
+     * Sizes are only final after the copy, which never reads past st_size;
+     * reserve room for the largest value they can take.
+     */
+    off_t bound = st.st_size;
+    if (codec == CODEC_LZ)
+        bound += (off_t)sizeof(uint32_t) * (st.st_size / LZ_BLOCK_SIZE + 1);
+    size_t width = varint_len((uint64_t)bound);
+
+    unsigned char hbuf[HEADER_MAX];
+    size_t hdr_len = header_encode(&hdr, width, hbuf);
+    off_t pos = ab->base + (off_t)ab->len;
+    if (abuf_put(arch_fd, ab, hbuf, hdr_len) < 0) {
+        close_input(in_fd);
+        return -1;
+    }
+
+    off_t copied = 0, stored;
+    uint32_t crc = 0;
+    if (codec == CODEC_LZ) {
+        stored = add_compressed(in_fd, data, arch_fd, ab, st.st_size, &copied,
+                                &crc);
+        if (stored < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+    } else if (data) {
+        if (abuf_put(arch_fd, ab, data, (size_t)st.st_size) < 0) return -1;
+        crc = crc32c(0, data, (size_t)st.st_size);
+        copied = stored = st.st_size;
+    } else if (st.st_size >= ZC_MIN_SIZE) {
+        /* big payloads bypass the buffer and are copied in the kernel */
+        if (abuf_flush(arch_fd, ab) < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+        copied = copy_range(in_fd, 0, arch_fd, ab->base, st.st_size,
+                            "Failed to copy input file");
+        if (copied < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+        /* checksum what landed in the archive, from the page cache */
+        if (crc_range(arch_fd, ab->base, copied, &crc,
+                      "Failed to checksum member") < 0) {
+            close_input(in_fd);
+            return -1;
+        }
+        ab->base += copied;
+        stored = copied;
+    } else {
+        while (copied < st.st_size) {
+            if (ab->len == ab->cap && abuf_flush(arch_fd, ab) < 0) {
+                close_input(in_fd);
+                return -1;
+            }
+            size_t want = ab->cap - ab->len;
+            if (st.st_size - copied < (off_t)want)
+                want = (size_t)(st.st_size - copied);
+            ssize_t r = read(in_fd, ab->buf + ab->len, want);
+            if (r == 0) break;
+            if (r < 0) {
+                perror("Failed to read input file");
+                close_input(in_fd);
+                return -1;
+            }
+            crc = crc32c(crc, ab->buf + ab->len, (size_t)r);
+            ab->len += (size_t)r;
+            copied += r;
+        }
+        stored = copied;
+    }
+    close_input(in_fd);
+
+    hdr.crc = crc;
+    hdr.flags |= HDR_HAS_CRC;
+    if (dedup && codec == CODEC_LZ && copied > 0) {
+        const struct indexEntry *src = dedup_find(idx, dedup, copied,
+                                                  CODEC_LZ, crc);
+        int eq = 0;
+        if (src && src->stored == stored &&
+            (abuf_flush(arch_fd, ab) < 0 ||
+             (eq = range_equal(arch_fd, pos + (off_t)hdr_len, arch_fd,
+                               entry_data(src), stored)) < 0))
+            return -1;
+        if (eq) {
+            /* forget the copy we just wrote, it is already in the archive */
+            ab->base = pos;
+            return add_ref(arch_fd, ab, idx, &hdr, src);
+        }
+    }
+    /* checksum and stored length are only known now */
+    hdr.size = copied;
+    hdr.stored = stored;
+    if (header_encode(&hdr, width, hbuf) != hdr_len) {
+        fprintf(stderr, "Internal error: header size changed\n");
+        return -1;
+    }
+    if (abuf_patch(arch_fd, ab, pos, hbuf, hdr_len) < 0) return -1;
+    if (index_push(idx, pos, (uint32_t)hdr_len, &hdr) < 0) return -1;
+    if (dedup && copied > 0 &&
+        hmap_put(dedup, dedup_key(copied, hdr.codec, crc), idx->count - 1) < 0)
+        return -1;
+    return 0;
+}
+
+/* Adds the file at `path` as member `file_name`. */
+static int add_one(int arch_fd, struct appendBuf *ab, struct archIndex *idx,
+                   const char *path, const char *file_name, int codec,
+                   struct hashMap *dedup) {
+    int in_fd = open(path, O_RDONLY);
+    if (in_fd < 0) {
+        perror(path);
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st) < 0) {
+        perror("Failed to stat input file");
+        close(in_fd);
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+        close(in_fd);
+        return 1;
+    }
+    return add_file(arch_fd, ab, idx, in_fd, NULL, &st, file_name, codec, dedup);
+}
+
+/*
+ * Small regular files queued for the I/O engine, which opens and reads a
+ * whole batch at once. They are appended in queue order when the batch is
+ * flushed, so the archive looks exactly as if they were added one by one.
+ */
+struct addBatch {
+    struct ioEngine *eng;
+    int arch_fd;
+    struct appendBuf *ab;
+    struct archIndex *idx;
+    int codec;
+    struct hashMap *dedup;
+    const char *archive_name;
+    off_t *committed;
+    int failed;
+    size_t count;
+    size_t used;
+    unsigned char *buf;
+    struct ioJob jobs[BATCH_FILES];
+    struct stat st[BATCH_FILES];
+    char *names[BATCH_FILES];
+};
+
+/* Files that go through the engine; big ones are copied in the kernel. */
+static int add_batch_takes(const struct addBatch *b, const struct stat *st) {
+    return b && S_ISREG(st->st_mode) && st->st_size < ZC_MIN_SIZE;
+}
+
+static void add_batch_drop(struct addBatch *b) {
+    for (size_t i = 0; i < b->count; i++) free(b->names[i]);
+    b->count = 0;
+    b->used = 0;
+}
+
+/* Reads every queued file and appends them. Returns -1 on fatal errors. */
+static int add_batch_flush(struct addBatch *b) {
+    int rc = 0;
+
+    if (b->count == 0) return 0;
+    if (iob_run(b->eng, b->jobs, b->count) < 0) {
+        perror("add: batched read");
+        rc = -1;
+    }
+    for (size_t i = 0; i < b->count && rc == 0; i++) {
+        const struct ioJob *job = &b->jobs[i];
+        int r;
+        if (job->result < 0) {
+            fprintf(stderr, "%s: %s\n", b->names[i], strerror((int)-job->result));
+            r = 1;
+        } else {
+            /* a file that shrank since it was listed is stored as read */
+            struct stat st = b->st[i];
+            st.st_size = job->result;
+            r = add_file(b->arch_fd, b->ab, b->idx, -1, job->buf, &st,
+                         b->names[i], b->codec, b->dedup);
+        }
+        if (r < 0) {
+            rc = -1;
+        } else if (r > 0) {
+            b->failed = 1;
+        } else {
+            *b->committed = b->ab->base + (off_t)b->ab->len;
+            printf("File '%s' added to archive '%s'.\n", b->names[i],
+                   b->archive_name);
+        }
+    }
+    add_batch_drop(b);
+    return rc;
+}
+
+/*
+ * Queues `path` (relative to `dir_fd`) to be added as `name`, flushing
+ * first if the batch is full.
+ */
+static int add_batch_queue(struct addBatch *b, int dir_fd, const char *path,
+                           const char *name, int flags, const struct stat *st) {
+    if ((b->count == BATCH_FILES || b->used + (size_t)st->st_size > BATCH_BYTES) &&
+        add_batch_flush(b) < 0)
+        return -1;
+
+    size_t name_len = strlen(name), path_len = strlen(path);
+    char *copy = malloc(name_len + path_len + 2);
+    if (!copy) {
+        perror("add: malloc");
+        return -1;
+    }
+    memcpy(copy, name, name_len + 1);
+    memcpy(copy + name_len + 1, path, path_len + 1);
+
+    struct ioJob *job = &b->jobs[b->count];
+    job->op = IOB_LOAD;
+    job->dir_fd = dir_fd;
+    job->path = copy + name_len + 1;
+    job->flags = flags;
+    job->mode = 0;
+    job->buf = b->buf + b->used;
+    job->len = (size_t)st->st_size;
+    job->result = 0;
+    b->st[b->count] = *st;
+    b->names[b->count++] = copy;
+    b->used += (size_t)st->st_size;
+    return 0;
+}
+
+/*
+ * State of a recursive add. `path` holds the name of the entry being
+ * visited; directories are walked through their fds with openat/fstatat,
+ * so no path is ever resolved twice.
+ */
+struct inodeLink {
+    dev_t  dev;
+    ino_t  ino;
+    size_t ent;
+};
+
+struct treeWalk {
+    int arch_fd;
+    struct appendBuf *ab;
+    struct archIndex *idx;
+    int codec;
+    struct hashMap *dedup;
+    struct addBatch *batch;
+    const char *archive_name;
+    off_t *committed;
+    dev_t arch_dev;
+    ino_t arch_ino;
+    struct hashMap links;
+    struct inodeLink *inodes;
+    size_t ninodes;
+    size_t inodes_cap;
+    int failed;
+    char path[MEMBER_NAME_MAX];
+};
+
+static void header_from_stat(struct memberHeader *hdr, const char *name,
+                             const struct stat *st) {
+    memset(hdr, 0, sizeof(*hdr));
+    strcpy(hdr->name, name);
+    hdr->mode = st->st_mode;
+    hdr->uid = st->st_uid;
+    hdr->gid = st->st_gid;
+    hdr->atime = st->st_atime;
+    hdr->mtime = st->st_mtime;
+}
+
+/* Adds a directory (no payload) or a symlink (payload = target). */
+static int add_special(struct treeWalk *w, const struct stat *st,
+                       const char *data, size_t len) {
+    struct memberHeader hdr;
+    unsigned char hbuf[HEADER_MAX];
+    off_t pos = w->ab->base + (off_t)w->ab->len;
+
+    header_from_stat(&hdr, w->path, st);
+    hdr.size = hdr.stored = (int64_t)len;
+    hdr.codec = CODEC_NONE;
+    hdr.crc = crc32c(0, data, len);
+    hdr.flags = HDR_HAS_CRC;
+    size_t hdr_len = header_encode(&hdr, 0, hbuf);
+    if (abuf_put(w->arch_fd, w->ab, hbuf, hdr_len) < 0 ||
+        (len && abuf_put(w->arch_fd, w->ab, data, len) < 0))
+        return -1;
+    return index_push(w->idx, pos, (uint32_t)hdr_len, &hdr);
+}
+
+static uint64_t inode_key(dev_t dev, ino_t ino) {
+    return mix64((uint64_t)dev ^ mix64((uint64_t)ino)) | 1;
+}
+
+/*
+ * Adds a regular file found in directory `dir_fd`. Further links to an
+ * inode already added in this run become hard link members that share
+ * the first copy's payload.
+ */
+static int add_tree_file(struct treeWalk *w, int dir_fd, const char *name,
+                         const struct stat *st) {
+    uint64_t key = inode_key(st->st_dev, st->st_ino), i;
+
+    if (st->st_nlink > 1 && hmap_get(&w->links, key, &i) &&
+        w->inodes[i].dev == st->st_dev && w->inodes[i].ino == st->st_ino) {
+        const struct indexEntry *src = &w->idx->ent[w->inodes[i].ent];
+        struct memberHeader hdr;
+        header_from_stat(&hdr, w->path, st);
+        hdr.flags = HDR_HARDLINK;
+        strcpy(hdr.link, entry_name(w->idx, src));
+        return add_ref(w->arch_fd, w->ab, w->idx, &hdr, src);
+    }
+
+    int in_fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW);
+    if (in_fd < 0) {
+        perror(w->path);
+        return 1;
+    }
+    int r = add_file(w->arch_fd, w->ab, w->idx, in_fd, NULL, st, w->path,
+                     w->codec, w->dedup);
+    if (r != 0 || st->st_nlink < 2) return r;
+
+    if (w->ninodes == w->inodes_cap) {
+        size_t cap = w->inodes_cap ? w->inodes_cap * 2 : 64;
+        struct inodeLink *inodes = realloc(w->inodes, cap * sizeof(*inodes));
+        if (!inodes) {
+            perror("add: realloc");
+            return -1;
+        }
+        w->inodes = inodes;
+        w->inodes_cap = cap;
+    }
+    w->inodes[w->ninodes].dev = st->st_dev;
+    w->inodes[w->ninodes].ino = st->st_ino;
+    w->inodes[w->ninodes].ent = w->idx->count - 1;
+    return hmap_put(&w->links, key, w->ninodes++);
+}
+
+/* Counts a finished member: 0 = added, 1 = skipped, -1 = fatal. */
+static int walk_result(struct treeWalk *w, int r) {
+    if (r > 0) {
+        w->failed = 1;
+    } else if (r == 0) {
+        *w->committed = w->ab->base + (off_t)w->ab->len;
+        printf("File '%s' added to archive '%s'.\n", w->path, w->archive_name);
+    }
+    return r < 0 ? -1 : 0;
+}
+
+/* Adds everything below the directory open on `dir_fd`, named w->path. */
+static int walk_dir(struct treeWalk *w, int dir_fd, size_t len) {
+    DIR *d = fdopendir(dir_fd);
+    if (!d) {
+        perror(w->path);
+        close(dir_fd);
+        w->failed = 1;
+        return 0;
+    }
+
+    int rc = 0;
+    struct dirent *de;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        size_t sep = len && w->path[len - 1] != '/';
+        size_t name_len = strlen(name);
+        if (len + sep + name_len >= MEMBER_NAME_MAX) {
+            fprintf(stderr, "Error: path '%s/%s' is too long\n", w->path, name);
+            w->failed = 1;
+            continue;
+        }
+        if (sep) w->path[len] = '/';
+        memcpy(w->path + len + sep, name, name_len + 1);
+        size_t child_len = len + sep + name_len;
+
+        struct stat st;
+        int r;
+        if (fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            perror(w->path);
+            r = 1;
+        } else if (st.st_dev == w->arch_dev && st.st_ino == w->arch_ino) {
+            /* never archive the archive itself */
+            r = 2;
+        } else if (st.st_nlink < 2 && add_batch_takes(w->batch, &st)) {
+            r = add_batch_queue(w->batch, dirfd(d), name, w->path,
+                                O_RDONLY | O_NOFOLLOW, &st) < 0 ? -1 : 2;
+        } else if (w->batch && add_batch_flush(w->batch) < 0) {
+            /* keep members in directory order */
+            r = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            r = add_special(w, &st, NULL, 0);
+            if (walk_result(w, r) < 0) {
+                rc = -1;
+                break;
+            }
+            int sub = openat(dirfd(d), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (sub < 0) {
+                perror(w->path);
+                r = 1;
+            } else {
+                r = walk_dir(w, sub, child_len) < 0 ? -1 : 2;
+            }
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t n = readlinkat(dirfd(d), name, target, sizeof(target));
+            if (n < 0 || (size_t)n >= sizeof(target)) {
+                perror(w->path);
+                r = 1;
+            } else {
+                r = add_special(w, &st, target, (size_t)n);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            r = add_tree_file(w, dirfd(d), name, &st);
+        } else {
+            fprintf(stderr, "Skipping '%s': unsupported file type\n", w->path);
+            r = 1;
+        }
+        if (r != 2 && walk_result(w, r) < 0) rc = -1;
+        if (r < 0) rc = -1;
+        w->path[len] = '\0';
+    }
+    /* queued jobs open their files relative to this directory */
+    if (rc == 0 && w->batch && add_batch_flush(w->batch) < 0) rc = -1;
+    closedir(d);
+    return rc;
+}
+
+/* Adds the directory `root`, stored as member_name(root). */
+static int add_tree(struct treeWalk *w, const char *root) {
+    const char *name = member_name(root);
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/') len--;
+    if (len >= MEMBER_NAME_MAX) {
+        fprintf(stderr, "Error: path '%s' is too long\n", root);
+        w->failed = 1;
+        return 0;
+    }
+    memcpy(w->path, name, len);
+    w->path[len] = '\0';
+    if (!member_name_safe(w->path)) {
+        fprintf(stderr, "Error: refusing to add '%s': empty name or '..' "
+                "component\n", root);
+        w->failed = 1;
+        return 0;
+    }
+
+    int fd = open(root, O_RDONLY | O_DIRECTORY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(root);
+        if (fd >= 0) close(fd);
+        w->failed = 1;
+        return 0;
+    }
+    if (walk_result(w, add_special(w, &st, NULL, 0)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return walk_dir(w, fd, len);
+}
+
+static int cmd_add(const char *archive_name, char **files, size_t nfiles,
+                   char **trees, size_t ntrees, int codec, int dedup,
+                   struct ioEngine *eng) {
+    int arch_fd = archive_open(archive_name, O_RDWR | O_CREAT, LOCK_EX);
+    if (arch_fd < 0) {
+        perror("Failed to open/create archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(arch_fd, &idx, 0) < 0) {
+        close(arch_fd);
+        return -1;
+    }
+
+    if (idx.count == 0 && idx.data_end <= idx.data_start) {
+        /* empty archive: start it in the current format */
+        struct archiveHeader ah = {0};
+        unsigned char abuf[ARCHIVE_HEADER_SIZE];
+        memcpy(ah.magic, ARCHIVE_MAGIC, sizeof(ah.magic));
+        ah.version = ARCHIVE_VERSION;
+        archive_header_encode(&ah, abuf);
+        if (full_pwrite(arch_fd, abuf, sizeof(abuf), 0,
+                        "Failed to write archive header") < 0) {
+            index_free(&idx);
+            close(arch_fd);
+            return -1;
+        }
+        idx.version = ARCHIVE_VERSION;
+        idx.data_start = idx.data_end = ARCHIVE_HEADER_SIZE;
+    } else if (idx.version != ARCHIVE_VERSION) {
+        /* new members are only written in the current record layout */
+        fprintf(stderr, "Error: '%s' uses archive format v%d; compact it "
+                "(-c) to upgrade it before adding files.\n",
+                archive_name, idx.version);
+        index_free(&idx);
+        close(arch_fd);
+        return -1;
+    }
+
+    /* every payload already in the archive can be shared, removed or not */
+    struct hashMap table = {0};
+    for (size_t i = 0; dedup && i < idx.count; i++) {
+        const struct indexEntry *e = &idx.ent[i];
+        if (e->data_off || !(e->flags & HDR_HAS_CRC) || e->size == 0) continue;
+        if (hmap_put(&table, dedup_key(e->size, e->codec, e->crc), i) < 0) {
+            index_free(&idx);
+            close(arch_fd);
+            return -1;
+        }
+    }
+
+    /*
+     * Drop the old index first: if we die before the new one is written,
+     * the archive is left without an index and is still readable by a scan.
+     */
+    if (ftruncate(arch_fd, idx.data_end) < 0) {
+        perror("Failed to prepare archive for append");
+        hmap_free(&table);
+        index_free(&idx);
+        close(arch_fd);
+        return -1;
+    }
+
+    struct appendBuf ab = {0};
+    ab.cap = ADD_BUF;
+    ab.base = idx.data_end;
+    ab.buf = malloc(ab.cap);
+    if (!ab.buf) {
+        perror("add: malloc");
+        hmap_free(&table);
+        index_free(&idx);
+        close(arch_fd);
+        return -1;
+    }
+
+    int rc = 0, fatal = 0;
+    off_t committed = ab.base;
+    struct addBatch *batch = eng ? calloc(1, sizeof(*batch)) : NULL;
+    if (batch && !(batch->buf = malloc(BATCH_BYTES))) {
+        free(batch);
+        batch = NULL;
+    }
+    if (batch) {
+        batch->eng = eng;
+        batch->arch_fd = arch_fd;
+        batch->ab = &ab;
+        batch->idx = &idx;
+        batch->codec = codec;
+        batch->dedup = dedup ? &table : NULL;
+        batch->archive_name = archive_name;
+        batch->committed = &committed;
+    }
+
+    int stripped = 0;
+    for (size_t i = 0; i < nfiles + ntrees && !stripped; i++) {
+        const char *path = i < nfiles ? files[i] : trees[i - nfiles];
+        if (path[0] == '/' && path[1] != '\0') {
+            fprintf(stderr, "Removing leading '/' from member names\n");
+            stripped = 1;
+        }
+    }
+
+    for (size_t i = 0; i < nfiles; i++) {
+        const char *name = member_name(files[i]);
+        struct stat st;
+        int r;
+        if (!member_name_safe(name)) {
+            fprintf(stderr, "Error: refusing to add '%s': empty name or '..' "
+                    "component\n", files[i]);
+            r = 1;
+        } else if (batch && stat(files[i], &st) == 0 &&
+                   add_batch_takes(batch, &st))
+            r = add_batch_queue(batch, AT_FDCWD, files[i], name, O_RDONLY,
+                                &st) < 0 ? -1 : 2;
+        else if (batch && add_batch_flush(batch) < 0)
+            r = -1;
+        else
+            r = add_one(arch_fd, &ab, &idx, files[i], name, codec,
+                        dedup ? &table : NULL);
+        if (r == 2) continue;
+        if (r < 0) {
+            /* forget the half-written member, keep everything before it */
+            ab.base = committed;
+            ab.len = 0;
+            rc = -1;
+            fatal = 1;
+            break;
+        }
+        if (r > 0) {
+            rc = -1;
+            continue;
+        }
+        committed = ab.base + (off_t)ab.len;
+        printf("File '%s' added to archive '%s'.\n", name, archive_name);
+    }
+    if (!fatal && batch && add_batch_flush(batch) < 0) {
+        ab.base = committed;
+        ab.len = 0;
+        rc = -1;
+        fatal = 1;
+    }
+
+    struct treeWalk *w = ntrees && !fatal ? calloc(1, sizeof(*w)) : NULL;
+    struct stat arch_st;
+    if (ntrees && !fatal && (!w || fstat(arch_fd, &arch_st) < 0)) {
+        perror("add");
+        rc = -1;
+    } else if (w) {
+        w->arch_fd = arch_fd;
+        w->ab = &ab;
+        w->idx = &idx;
+        w->codec = codec;
+        w->dedup = dedup ? &table : NULL;
+        w->batch = batch;
+        w->archive_name = archive_name;
+        w->committed = &committed;
+        w->arch_dev = arch_st.st_dev;
+        w->arch_ino = arch_st.st_ino;
+        for (size_t i = 0; i < ntrees; i++) {
+            if (add_tree(w, trees[i]) < 0) {
+                ab.base = committed;
+                ab.len = 0;
+                rc = -1;
+                break;
+            }
+        }
+        if (w->failed) rc = -1;
+        hmap_free(&w->links);
+        free(w->inodes);
+    }
+    free(w);
+    if (batch) {
+        if (batch->failed) rc = -1;
+        add_batch_drop(batch);
+        free(batch->buf);
+        free(batch);
+    }
+
+    /*
+     * The index is the commit record: member data must be on disk before
+     * an index that refers to it can be.
+     */
+    if (abuf_flush(arch_fd, &ab) < 0) {
+        rc = -1;
+    } else if (fdatasync(arch_fd) < 0) {
+        perror("Failed to sync archive");
+        rc = -1;
+    } else if (index_write(arch_fd, &idx, ab.base) < 0) {
+        rc = -1;
+    }
+
+    free(ab.buf);
+    free(ab.zraw);
+    free(ab.zout);
+    hmap_free(&table);
+    index_free(&idx);
+    close(arch_fd);
+    return rc;
+}
+
+/* Whether dead bytes exceed `threshold` of the archive's members. */
+static int compact_due(const struct archIndex *idx, double threshold) {
+    off_t live, dead;
+    index_usage(idx, &live, &dead);
+    return live + dead > 0 && (double)dead > threshold * (double)(live + dead);
+}
+
+/*
+ * Rewrites the archive without removed members. With a `threshold` of 0
+ * or more that only happens if compact_due still holds once the lock is
+ * taken, since other writers may have changed the archive in between.
+ */
+static int cmd_compact(const char *archive_name, double threshold) {
+    int in_fd = archive_open(archive_name, O_RDONLY, LOCK_EX);
+    if (in_fd < 0) {
+        perror("compact: cannot open archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(in_fd, &idx, 0) < 0) {
+        close(in_fd);
+        return -1;
+    }
+    if (threshold >= 0 && !compact_due(&idx, threshold)) {
+        index_free(&idx);
+        close(in_fd);
+        return 0;
+    }
+
+    char tmp_name[512];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmpXXXXXX", archive_name);
+
+    int tmp_fd = mkstemp(tmp_name);
+    if (tmp_fd < 0) {
+        perror("compact: cannot create temp file");
+        index_free(&idx);
+        close(in_fd);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st) == 0) fchmod(tmp_fd, st.st_mode);
+
+    struct archIndex out;
+    struct hashMap moved = {0};
+    index_init(&out);
+
+    /* keep the original member order in the rewritten archive */
+    if (idx.count > 1)
+        qsort(idx.ent, idx.count, sizeof(*idx.ent), entry_cmp_off);
+
+    /* the rewritten archive is always in the current format */
+    struct archiveHeader ah = {0};
+    unsigned char abuf[ARCHIVE_HEADER_SIZE];
+    memcpy(ah.magic, ARCHIVE_MAGIC, sizeof(ah.magic));
+    ah.version = ARCHIVE_VERSION;
+    archive_header_encode(&ah, abuf);
+    if (full_pwrite(tmp_fd, abuf, sizeof(abuf), 0, "compact: write header") < 0)
+        goto fail;
+    out.version = ARCHIVE_VERSION;
+    out.data_start = ARCHIVE_HEADER_SIZE;
+
+    struct memberHeader hdr;
+    unsigned char hbuf[HEADER_MAX];
+    off_t pos = ARCHIVE_HEADER_SIZE;
+
+    for (size_t i = 0; i < idx.count; i++) {
+        const struct indexEntry *e = &idx.ent[i];
+        uint32_t in_len;
+        uint64_t new_data;
+        if (e->deleted) continue;
+
+        if (header_read(&idx, in_fd, e->hdr_off, &hdr, &in_len) < 0)
+            goto fail;
+
+        /*
+         * Shared payloads are copied once, by the first live member that
+         * uses them; that member may be a reference whose owner was removed.
+         */
+        off_t old_data = entry_data(e);
+        if (hmap_get(&moved, (uint64_t)old_data, &new_data)) {
+            hdr.flags |= HDR_DEDUP;
+            hdr.data_off = (int64_t)new_data;
+            size_t out_len = header_encode(&hdr, 0, hbuf);
+            if (full_pwrite(tmp_fd, hbuf, out_len, pos,
+                            "compact: write header") < 0 ||
+                index_push(&out, pos, (uint32_t)out_len, &hdr) < 0)
+                goto fail;
+            pos += (off_t)out_len;
+            continue;
+        }
+        hdr.flags &= ~(uint32_t)HDR_DEDUP;
+        hdr.data_off = 0;
+
+        size_t out_len = header_encode(&hdr, 0, hbuf);
+        if (full_pwrite(tmp_fd, hbuf, out_len, pos, "compact: write header") < 0)
+            goto fail;
+        if (hmap_put(&moved, (uint64_t)old_data,
+                     (uint64_t)(pos + (off_t)out_len)) < 0)
+            goto fail;
+        if (copy_range(in_fd, old_data, tmp_fd,
+                       pos + (off_t)out_len, hdr.stored,
+                       "compact: copy data") != hdr.stored) {
+            fprintf(stderr, "compact: broken archive, short member data\n");
+            goto fail;
+        }
+        if (!(hdr.flags & HDR_HAS_CRC)) {
+            /* members from older formats get their checksum now */
+            hdr.crc = 0;
+            hdr.flags |= HDR_HAS_CRC;
+            if (crc_range(tmp_fd, pos + (off_t)out_len, hdr.stored, &hdr.crc,
+                          "compact: checksum") < 0)
+                goto fail;
+            header_encode(&hdr, 0, hbuf);
+            if (full_pwrite(tmp_fd, hbuf, out_len, pos,
+                            "compact: write header") < 0)
+                goto fail;
+        }
+        if (index_push(&out, pos, (uint32_t)out_len, &hdr) < 0) goto fail;
+        pos += (off_t)out_len + hdr.stored;
+    }
+    if (index_write(tmp_fd, &out, pos) < 0) goto fail;
+
+    if (fsync(tmp_fd) < 0) {
+        perror("compact: fsync");
+        goto fail;
+    }
+    close(tmp_fd);
+    index_free(&idx);
+    index_free(&out);
+    hmap_free(&moved);
+
+    /* still holding the lock, so nobody can be appending to the old file */
+    if (rename(tmp_name, archive_name) < 0) {
+        perror("compact: rename failed");
+        unlink(tmp_name);
+        close(in_fd);
+        return -1;
+    }
+    close(in_fd);
+    return 0;
+
+fail:
+    close(tmp_fd);
+    close(in_fd);
+    index_free(&idx);
+    index_free(&out);
+    hmap_free(&moved);
+    unlink(tmp_name);
+    return -1;
+}
+
+/*
+ * Decodes a CODEC_LZ payload of `stored` bytes at `off` into `out_fd`, or
+ * into the `dst_cap` bytes at `dst` when that is set, reading the archive
+ * in BIG_BUF chunks and holding one block at a time. The CRC of the
+ * stored bytes is accumulated into `crc` on the way. Returns the number
+ * of bytes produced, or -1.
+ */
+static off_t lz_extract(const struct archIndex *idx, int arch_fd, off_t off,
+                        off_t stored, int out_fd, unsigned char *dst,
+                        size_t dst_cap, uint32_t *crc) {
+    unsigned char *buf = NULL, *out = malloc(LZ_BLOCK_SIZE);
+    const unsigned char *in;
+    size_t have = 0, pos = 0;
+    off_t left = stored, produced = 0;
+
+    if ((in = archive_mapped(idx, off, stored))) {
+        /* the whole payload is already addressable */
+        have = (size_t)stored;
+        left = 0;
+        *crc = crc32c(*crc, in, have);
+    } else {
+        in = buf = malloc(BIG_BUF);
+    }
+    if (!in || !out) {
+        perror("extract: malloc");
+        goto fail;
+    }
+
+    while (left > 0 || pos < have) {
+        uint32_t blk = 0;
+        size_t need = sizeof(blk);
+        if (have - pos >= sizeof(blk)) {
+            blk = (uint32_t)le_get(in + pos, sizeof(blk));
+            need += blk & ~LZ_RAW_BLOCK;
+        }
+        if (need > LZ_BOUND(LZ_BLOCK_SIZE) + sizeof(blk)) {
+            fprintf(stderr, "Broken archive: bad compressed block\n");
+            goto fail;
+        }
+        if (have - pos < need) {
+            if (left == 0) {
+                fprintf(stderr, "Broken archive: truncated compressed block\n");
+                goto fail;
+            }
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            size_t want = BIG_BUF - have;
+            if ((off_t)want > left) want = (size_t)left;
+            if (full_pread(arch_fd, buf + have, want, off,
+                           "Error extracting archived data") < 0)
+                goto fail;
+            *crc = crc32c(*crc, buf + have, want);
+            have += want;
+            off += (off_t)want;
+            left -= (off_t)want;
+            continue;
+        }
+
+        const unsigned char *data = in + pos + sizeof(blk);
+        size_t len = blk & ~LZ_RAW_BLOCK;
+        unsigned char *to = dst ? dst + produced : out;
+        size_t room = dst ? dst_cap - (size_t)produced : LZ_BLOCK_SIZE;
+        if (room > LZ_BLOCK_SIZE) room = LZ_BLOCK_SIZE;
+        long n;
+        if (blk & LZ_RAW_BLOCK) {
+            n = len <= room ? (long)len : -1;
+        } else {
+            n = lz_decompress(data, len, to, room);
+            data = to;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Broken archive: bad compressed block\n");
+            goto fail;
+        }
+        if (dst) {
+            if (data != to) memcpy(to, data, (size_t)n);
+        } else if (full_pwrite(out_fd, data, (size_t)n, produced,
+                               "Error writing extracted file") < 0) {
+            goto fail;
+        }
+        produced += n;
+        pos += need;
+    }
+    free(buf);
+    free(out);
+    return produced;
+
+fail:
+    free(buf);
+    free(out);
+    return -1;
+}
+
+static void close_dir(int dir_fd) {
+    if (dir_fd >= 0) close(dir_fd);
+}
+
+/*
+ * Opens the directory that holds member `name`, with any leading '/'
+ * dropped, walking down from the current directory one component at a
+ * time with O_NOFOLLOW, so nothing is ever created through a symlink,
+ * one extracted earlier included. Missing directories are made when
+ * `create` is set. Returns the fd (AT_FDCWD for top-level names, release
+ * it with close_dir) and sets *base to the last component, or returns -1.
+ */
+static int open_parent(const char *name, int create, const char **base) {
+    int dir_fd = AT_FDCWD;
+    const char *p = member_name(name);
+    char comp[NAME_MAX + 1];
+
+    for (const char *slash; (slash = strchr(p, '/')) && slash[1]; p = slash + 1) {
+        size_t len = (size_t)(slash - p);
+        if (len == 0 || (len == 1 && p[0] == '.')) continue;
+        if (len > NAME_MAX) {
+            close_dir(dir_fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+        if (create && mkdirat(dir_fd, comp, 0777) < 0 && errno != EEXIST) {
+            int err = errno;
+            close_dir(dir_fd);
+            errno = err;
+            return -1;
+        }
+        int fd = openat(dir_fd, comp,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int err = errno;
+        close_dir(dir_fd);
+        if (fd < 0) {
+            errno = err;
+            return -1;
+        }
+        dir_fd = fd;
+    }
+    *base = p;
+    return dir_fd;
+}
+
+/* Directories and symlinks: neither has data to copy. */
+static int extract_special(const struct archIndex *idx, int arch_fd,
+                           const struct memberHeader *hdr, off_t data_off) {
+    const char *base;
+    int dir_fd = open_parent(hdr->name, 1, &base);
+    if (dir_fd == -1) {
+        perror(hdr->name);
+        return -1;
+    }
+
+    if (S_ISDIR(hdr->mode)) {
+        /* kept writable until extract_dir_finish applies the real mode */
+        int r = mkdirat(dir_fd, base, 0700);
+        if (r < 0 && errno == EEXIST) {
+            /* an existing directory is reused, a symlink is in the way */
+            struct stat st;
+            r = fstatat(dir_fd, base, &st, AT_SYMLINK_NOFOLLOW);
+            if (r == 0 && !S_ISDIR(st.st_mode)) {
+                errno = ENOTDIR;
+                r = -1;
+            }
+        }
+        if (r < 0) perror(hdr->name);
+        close_dir(dir_fd);
+        return r;
+    }
+
+    char target[PATH_MAX];
+    int r = -1;
+    if (hdr->codec != CODEC_NONE || hdr->stored != hdr->size ||
+        hdr->size <= 0 || hdr->size >= PATH_MAX) {
+        fprintf(stderr, "Broken archive: bad symlink '%s'\n", hdr->name);
+    } else if (archive_read(idx, arch_fd, target, (size_t)hdr->size,
+                            data_off) != (ssize_t)hdr->size) {
+        fprintf(stderr, "Broken archive: short member data\n");
+    } else if ((hdr->flags & HDR_HAS_CRC) &&
+               crc32c(0, target, (size_t)hdr->size) != hdr->crc) {
+        fprintf(stderr, "Checksum mismatch in '%s'\n", hdr->name);
+    } else {
+        target[hdr->size] = '\0';
+        unlinkat(dir_fd, base, 0);
+        r = symlinkat(target, dir_fd, base);
+        if (r < 0) perror(hdr->name);
+    }
+    if (r == 0) {
+        fchownat(dir_fd, base, hdr->uid, hdr->gid, AT_SYMLINK_NOFOLLOW);
+        struct timespec ts[2] = {{hdr->atime, 0}, {hdr->mtime, 0}};
+        utimensat(dir_fd, base, ts, AT_SYMLINK_NOFOLLOW);
+    }
+    close_dir(dir_fd);
+    return r;
+}
+
+/* Applies mode and times to an extracted directory, once it is filled. */
+static void extract_dir_finish(const struct archIndex *idx, int arch_fd,
+                               const struct indexEntry *e) {
+    struct memberHeader hdr;
+    uint32_t hdr_len;
+    if (header_read(idx, arch_fd, e->hdr_off, &hdr, &hdr_len) < 0) return;
+
+    const char *base;
+    int dir_fd = open_parent(hdr.name, 0, &base);
+    if (dir_fd == -1) return;
+    int fd = openat(dir_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    close_dir(dir_fd);
+    if (fd < 0) return;
+    fchmod(fd, hdr.mode & 07777);
+    fchown(fd, hdr.uid, hdr.gid);
+    struct timespec ts[2] = {{hdr.atime, 0}, {hdr.mtime, 0}};
+    futimens(fd, ts);
+    close(fd);
+}
+
+/*
+ * Reads the header of the member behind `e` and checks it against the
+ * index. Returns the offset of its payload, or -1.
+ */
+static off_t extract_header(const struct archIndex *idx, int arch_fd,
+                            const struct indexEntry *e,
+                            struct memberHeader *hdr) {
+    uint32_t hdr_len;
+    if (header_read(idx, arch_fd, e->hdr_off, hdr, &hdr_len) < 0)
+        return -1;
+    /* the tombstone may lag behind the index's after a crash, see mark_deleted */
+    if (hdr->size != e->size || hdr->stored != e->stored ||
+        hdr->data_off != e->data_off) {
+        fprintf(stderr, "Broken archive: index does not match header\n");
+        return -1;
+    }
+    if (!member_name_safe(hdr->name) ||
+        ((hdr->flags & HDR_HARDLINK) && !member_name_safe(hdr->link))) {
+        fprintf(stderr, "Refusing to extract '%s': empty name or '..' "
+                "component\n", hdr->name);
+        return -1;
+    }
+
+    if (hdr->size > MAX_EXTRACT_SIZE) {
+        fprintf(stderr, "File too large to extract: %lld bytes\n",
+                (long long)hdr->size);
+        return -1;
+    }
+    return hdr->data_off ? hdr->data_off : e->hdr_off + (off_t)hdr_len;
+}
+
+/*
+ * Applies owner, mode and times to an extracted file and drops the
+ * member. They go through `out_fd` while the file is still open (it is
+ * closed here), else to `base` in the directory `dir_fd`, without
+ * following a symlink that may have replaced it since.
+ */
+static int extract_finish(const struct archIndex *idx, int arch_fd,
+                          struct indexEntry *e, const struct memberHeader *hdr,
+                          int out_fd, int dir_fd, const char *base) {
+    struct timespec ts[2] = {{hdr->atime, 0}, {hdr->mtime, 0}};
+    if (out_fd >= 0) {
+        fchown(out_fd, hdr->uid, hdr->gid);
+        fchmod(out_fd, hdr->mode & 07777);
+        futimens(out_fd, ts);
+        close(out_fd);
+    } else {
+        fchownat(dir_fd, base, hdr->uid, hdr->gid, AT_SYMLINK_NOFOLLOW);
+        fchmodat(dir_fd, base, hdr->mode & 07777, AT_SYMLINK_NOFOLLOW);
+        utimensat(dir_fd, base, ts, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if (mark_deleted(idx, arch_fd, e) < 0) return -1;
+
+    printf("Extracted '%s'.\n", hdr->name);
+    return 0;
+}
+
+/*
+ * Extracts one member. A hard link is recreated with linkat() when
+ * `link_to` names its already extracted target, else written as a copy.
+ */
+static int extract_member(const struct archIndex *idx, int arch_fd,
+                          struct indexEntry *e, const char *link_to) {
+    struct memberHeader hdr;
+    off_t data_off = extract_header(idx, arch_fd, e, &hdr), n;
+    if (data_off < 0) return -1;
+
+    if (S_ISDIR(hdr.mode) || S_ISLNK(hdr.mode)) {
+        if (extract_special(idx, arch_fd, &hdr, data_off) < 0 ||
+            mark_deleted(idx, arch_fd, e) < 0)
+            return -1;
+        printf("Extracted '%s'.\n", hdr.name);
+        return 0;
+    }
+
+    const char *base;
+    int dir_fd = open_parent(hdr.name, 1, &base);
+    if (dir_fd == -1) {
+        perror(hdr.name);
+        return -1;
+    }
+    if (link_to) {
+        const char *link_base;
+        int link_dir = open_parent(link_to, 0, &link_base);
+        unlinkat(dir_fd, base, 0);
+        int r = link_dir == -1 ? -1 : linkat(link_dir, link_base, dir_fd, base, 0);
+        close_dir(link_dir);
+        if (r == 0) {
+            close_dir(dir_fd);
+            if (mark_deleted(idx, arch_fd, e) < 0) return -1;
+            printf("Extracted '%s' (link to '%s').\n", hdr.name, link_to);
+            return 0;
+        }
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    int out_fd = openat(dir_fd, base, flags, hdr.mode);
+    if (out_fd < 0 && errno == ELOOP) {
+        /* a symlink in the way is replaced, not written through */
+        unlinkat(dir_fd, base, 0);
+        out_fd = openat(dir_fd, base, flags, hdr.mode);
+    }
+    if (out_fd < 0) {
+        perror("Failed to create output file");
+        close_dir(dir_fd);
+        return -1;
+    }
+    uint32_t crc = 0;
+    const unsigned char *data = hdr.codec == CODEC_NONE ?
+        archive_mapped(idx, data_off, hdr.stored) : NULL;
+    archive_advise(idx, data_off, hdr.stored, MADV_WILLNEED);
+    if (hdr.codec == CODEC_LZ) {
+        n = lz_extract(idx, arch_fd, data_off, hdr.stored, out_fd, NULL, 0,
+                       &crc);
+    } else if (data) {
+        /* write straight from the mapping and hash the same pages */
+        n = full_pwrite(out_fd, data, (size_t)hdr.stored, 0,
+                        "Error writing extracted file") < 0 ? -1 : hdr.stored;
+        crc = crc32c(0, data, (size_t)hdr.stored);
+    } else if (hdr.codec == CODEC_NONE) {
+        n = copy_range(arch_fd, data_off, out_fd, 0, hdr.stored,
+                       "Error extracting archived data");
+        if (n == hdr.stored && (hdr.flags & HDR_HAS_CRC) &&
+            crc_range(arch_fd, data_off, hdr.stored, &crc,
+                      "Error verifying archived data") < 0)
+            n = -1;
+    } else {
+        fprintf(stderr, "Unknown codec %u for '%s'\n", hdr.codec, hdr.name);
+        n = -1;
+    }
+    if (n != hdr.size) {
+        if (n >= 0) fprintf(stderr, "Broken archive: short member data\n");
+        close(out_fd);
+        close_dir(dir_fd);
+        return -1;
+    }
+    if ((hdr.flags & HDR_HAS_CRC) && crc != hdr.crc) {
+        fprintf(stderr, "Checksum mismatch in '%s', output removed\n", hdr.name);
+        close(out_fd);
+        unlinkat(dir_fd, base, 0);
+        close_dir(dir_fd);
+        return -1;
+    }
+    int r = extract_finish(idx, arch_fd, e, &hdr, out_fd, dir_fd, base);
+    close_dir(dir_fd);
+    return r;
+}
+
+/*
+ * Extraction plan shared by the worker threads. Every job is a distinct
+ * index entry, so workers only contend for the next job number.
+ */
+struct extractPlan {
+    int arch_fd;
+    const struct archIndex *idx;
+    struct ioEngine *eng;
+    struct indexEntry **jobs;
+    size_t count;
+    size_t next;
+    int failed;
+    pthread_mutex_t lock;
+};
+
+static void *extract_worker(void *arg) {
+    struct extractPlan *plan = arg;
+
+    while (1) {
+        pthread_mutex_lock(&plan->lock);
+        size_t i = plan->next++;
+        pthread_mutex_unlock(&plan->lock);
+        if (i >= plan->count) break;
+
+        if (extract_member(plan->idx, plan->arch_fd, plan->jobs[i], NULL) < 0) {
+            pthread_mutex_lock(&plan->lock);
+            plan->failed = 1;
+            pthread_mutex_unlock(&plan->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Runs `fn(arg)` on `jobs` threads, or inline if no thread can start. */
+static void run_workers(void *(*fn)(void *), void *arg, int jobs) {
+    pthread_t *tids = jobs > 1 ? malloc((size_t)jobs * sizeof(*tids)) : NULL;
+    int started = 0;
+
+    for (; tids && started < jobs; started++) {
+        if (pthread_create(&tids[started], NULL, fn, arg) != 0) {
+            fprintf(stderr, "Cannot start worker thread\n");
+            break;
+        }
+    }
+    if (started == 0) fn(arg);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+static int run_extract_plan(struct extractPlan *plan, int jobs) {
+    if (jobs > (int)plan->count) jobs = (int)plan->count;
+    run_workers(extract_worker, plan, jobs);
+    return plan->failed ? -1 : 0;
+}
+
+/*
+ * Small files decoded and checked in memory, then created and written by
+ * the I/O engine a whole batch at a time. Owner, mode and times are
+ * applied once each write has completed. Every job is opened relative to
+ * its parent directory from open_parent; consecutive files in the same
+ * directory share the fd, which `own_dir` marks on the job that opened it.
+ */
+struct extractBatch {
+    size_t count;
+    size_t used;
+    unsigned char *buf;
+    struct memberHeader *hdr;
+    struct indexEntry *ent[BATCH_FILES];
+    struct ioJob jobs[BATCH_FILES];
+    unsigned char own_dir[BATCH_FILES];
+};
+
+static int extract_batch_takes(const struct indexEntry *e) {
+    return S_ISREG(e->mode) && e->size < ZC_MIN_SIZE;
+}
+
+static int extract_batch_flush(struct extractPlan *plan,
+                               struct extractBatch *b) {
+    int rc = 0;
+
+    if (b->count > 0 && iob_run(plan->eng, b->jobs, b->count) < 0) {
+        perror("extract: batched write");
+        for (size_t i = 0; i < b->count; i++)
+            if (b->own_dir[i]) close_dir(b->jobs[i].dir_fd);
+        b->count = b->used = 0;
+        return -1;
+    }
+    for (size_t i = 0; i < b->count; i++) {
+        const struct ioJob *job = &b->jobs[i];
+        if (job->result == -ENOENT || job->result == -ELOOP) {
+            /* a missing parent or a symlink in the way: the plain path copes */
+            if (extract_member(plan->idx, plan->arch_fd, b->ent[i], NULL) < 0)
+                rc = -1;
+        } else if (job->result < 0) {
+            fprintf(stderr, "Failed to extract '%s': %s\n", b->hdr[i].name,
+                    strerror((int)-job->result));
+            rc = -1;
+        } else if ((size_t)job->result != job->len) {
+            fprintf(stderr, "Failed to extract '%s': short write\n",
+                    b->hdr[i].name);
+            unlinkat(job->dir_fd, job->path, 0);
+            rc = -1;
+        } else {
+            if (extract_finish(plan->idx, plan->arch_fd, b->ent[i], &b->hdr[i],
+                               -1, job->dir_fd, job->path) < 0)
+                rc = -1;
+        }
+    }
+    for (size_t i = 0; i < b->count; i++)
+        if (b->own_dir[i]) close_dir(b->jobs[i].dir_fd);
+    b->count = b->used = 0;
+    return rc;
+}
+
+/* Decodes member `e` into the batch and queues its write. */
+static int extract_batch_queue(struct extractPlan *plan,
+                               struct extractBatch *b, struct indexEntry *e) {
+    const struct archIndex *idx = plan->idx;
+    int rc = 0;
+
+    if ((b->count == BATCH_FILES || b->used + (size_t)e->size > BATCH_BYTES) &&
+        extract_batch_flush(plan, b) < 0)
+        rc = -1;
+
+    struct memberHeader *hdr = &b->hdr[b->count];
+    off_t data_off = extract_header(idx, plan->arch_fd, e, hdr), n;
+    if (data_off < 0) return -1;
+
+    unsigned char *data = b->buf + b->used;
+    const unsigned char *mapped = hdr->codec == CODEC_NONE ?
+        archive_mapped(idx, data_off, hdr->stored) : NULL;
+    uint32_t crc = 0;
+    if (hdr->codec == CODEC_LZ) {
+        n = lz_extract(idx, plan->arch_fd, data_off, hdr->stored, -1, data,
+                       (size_t)hdr->size, &crc);
+    } else if (mapped) {
+        /* written straight from the mapping */
+        data = (unsigned char *)mapped;
+        n = hdr->stored;
+        crc = crc32c(0, data, (size_t)n);
+    } else if (hdr->codec == CODEC_NONE) {
+        n = archive_read(idx, plan->arch_fd, data, (size_t)hdr->stored, data_off);
+        if (n < 0) perror("Error extracting archived data");
+        else crc = crc32c(0, data, (size_t)n);
+    } else {
+        fprintf(stderr, "Unknown codec %u for '%s'\n", hdr->codec, hdr->name);
+        n = -1;
+    }
+    if (n != hdr->size) {
+        if (n >= 0) fprintf(stderr, "Broken archive: short member data\n");
+        return -1;
+    }
+    if ((hdr->flags & HDR_HAS_CRC) && crc != hdr->crc) {
+        fprintf(stderr, "Checksum mismatch in '%s'\n", hdr->name);
+        return -1;
+    }
+
+    struct ioJob *job = &b->jobs[b->count];
+    const struct ioJob *prev = b->count ? job - 1 : NULL;
+    const char *slash = strrchr(hdr->name, '/');
+    size_t dir_len = slash ? (size_t)(slash - hdr->name) + 1 : 0;
+    if (prev && prev->path - b->hdr[b->count - 1].name == (ptrdiff_t)dir_len &&
+        memcmp(b->hdr[b->count - 1].name, hdr->name, dir_len) == 0) {
+        job->dir_fd = prev->dir_fd;
+        job->path = hdr->name + dir_len;
+        b->own_dir[b->count] = 0;
+    } else {
+        job->dir_fd = open_parent(hdr->name, 1, &job->path);
+        if (job->dir_fd == -1) {
+            perror(hdr->name);
+            return -1;
+        }
+        b->own_dir[b->count] = 1;
+    }
+    job->op = IOB_STORE;
+    job->flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    job->mode = hdr->mode;
+    job->buf = data;
+    job->len = (size_t)hdr->size;
+    job->result = 0;
+    b->ent[b->count++] = e;
+    if (data == b->buf + b->used) b->used += (size_t)hdr->size;
+    return rc;
+}
+
+/*
+ * Sends the small regular files among `files` through the I/O engine and
+ * moves the rest to the front of the array. Returns how many are left
+ * for the worker threads.
+ */
+static size_t extract_batched(struct extractPlan *plan,
+                              struct indexEntry **files, size_t n) {
+    struct extractBatch b = {0};
+    size_t rest = 0;
+
+    b.buf = malloc(BATCH_BYTES);
+    b.hdr = malloc(BATCH_FILES * sizeof(*b.hdr));
+    if (!b.buf || !b.hdr) {
+        free(b.buf);
+        free(b.hdr);
+        return n;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct indexEntry *e = files[i];
+        if (!extract_batch_takes(e)) {
+            files[i] = files[rest];
+            files[rest++] = e;
+            continue;
+        }
+        if (extract_batch_queue(plan, &b, e) < 0) plan->failed = 1;
+    }
+    if (extract_batch_flush(plan, &b) < 0) plan->failed = 1;
+    free(b.buf);
+    free(b.hdr);
+    return rest;
+}
+
+static int job_cmp_name(const void *a, const void *b, void *arg) {
+    const struct archIndex *idx = arg;
+    return strcmp(entry_name(idx, *(struct indexEntry *const *)a),
+                  entry_name(idx, *(struct indexEntry *const *)b));
+}
+
+/* Binary search in jobs sorted by job_cmp_name. */
+static struct indexEntry *job_find(const struct archIndex *idx,
+                                   struct indexEntry **jobs, size_t n,
+                                   const char *name) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(entry_name(idx, jobs[mid]), name);
+        if (c == 0) return jobs[mid];
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+/*
+ * Runs a plan in phases: directories are created first, files and symlinks
+ * are extracted in parallel, then hard links are made to targets that were
+ * just written, and directories get their mode and times last, children
+ * before parents.
+ */
+static int run_extract_phases(struct extractPlan *plan, int jobs) {
+    const struct archIndex *idx = plan->idx;
+    struct indexEntry **all = plan->jobs;
+    size_t count = plan->count, ndirs = 0, nfiles = 0, k = 0;
+    struct indexEntry **order = malloc(count * sizeof(*order) + 1);
+    int rc = 0;
+
+    if (!order) {
+        perror("extract: malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+        if (S_ISDIR(all[i]->mode)) order[k++] = all[i];
+    ndirs = k;
+    for (size_t i = 0; i < count; i++)
+        if (!S_ISDIR(all[i]->mode) && !(all[i]->flags & HDR_HARDLINK))
+            order[k++] = all[i];
+    nfiles = k - ndirs;
+    for (size_t i = 0; i < count; i++)
+        if (!S_ISDIR(all[i]->mode) && (all[i]->flags & HDR_HARDLINK))
+            order[k++] = all[i];
+
+    for (size_t i = 0; i < ndirs; i++)
+        if (extract_member(idx, plan->arch_fd, order[i], NULL) < 0) rc = -1;
+
+    plan->jobs = order + ndirs;
+    plan->count = plan->eng ? extract_batched(plan, plan->jobs, nfiles) : nfiles;
+    if (plan->count > 0 && run_extract_plan(plan, jobs) < 0) rc = -1;
+    if (plan->failed) rc = -1;
+    plan->jobs = all;
+    plan->count = count;
+
+    struct indexEntry **files = order + ndirs;
+    if (ndirs + nfiles < count)
+        qsort_r(files, nfiles, sizeof(*files), job_cmp_name, (void *)idx);
+    for (size_t i = ndirs + nfiles; i < count; i++) {
+        struct memberHeader hdr;
+        uint32_t hdr_len;
+        if (header_read(idx, plan->arch_fd, order[i]->hdr_off, &hdr,
+                        &hdr_len) < 0) {
+            rc = -1;
+            continue;
+        }
+        const struct indexEntry *target = job_find(idx, files, nfiles, hdr.link);
+        const char *link_to = target && target->deleted ? hdr.link : NULL;
+        if (extract_member(idx, plan->arch_fd, order[i], link_to) < 0) rc = -1;
+    }
+
+    qsort_r(order, ndirs, sizeof(*order), job_cmp_name, (void *)idx);
+    for (size_t i = ndirs; i-- > 0;)
+        if (order[i]->deleted) extract_dir_finish(idx, plan->arch_fd, order[i]);
+
+    free(order);
+    return rc;
+}
+
+/*
+ * Extracts the named members, or every live member when `all` is set.
+ * Members are written concurrently by `jobs` threads using pread/
+ * copy_file_range at the offsets from the index. When a name occurs more
+ * than once, the newest copy is written and the older ones are dropped.
+ */
+static int cmd_extract(const char *archive_name, char **names, size_t nnames,
+                       int all, int jobs, double threshold, int use_map,
+                       struct ioEngine *eng) {
+    int arch_fd = archive_open(archive_name, O_RDWR, LOCK_EX);
+    if (arch_fd < 0) {
+        perror("Failed to open archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(arch_fd, &idx, use_map) < 0) {
+        close(arch_fd);
+        return -1;
+    }
+
+    struct extractPlan plan = {0};
+    plan.arch_fd = arch_fd;
+    plan.idx = &idx;
+    plan.eng = eng;
+    pthread_mutex_init(&plan.lock, NULL);
+    plan.jobs = malloc((all ? idx.count : nnames) * sizeof(*plan.jobs) + 1);
+    if (!plan.jobs) {
+        perror("extract: malloc");
+        goto fail;
+    }
+
+    int rc = 0;
+    if (all) {
+        size_t i = 0;
+        while (i < idx.count) {
+            const char *name = entry_name(&idx, &idx.ent[i]);
+            struct indexEntry *newest = NULL;
+            for (; i < idx.count && strcmp(entry_name(&idx, &idx.ent[i]), name) == 0; i++) {
+                struct indexEntry *e = &idx.ent[i];
+                if (e->deleted) continue;
+                if (newest && mark_deleted(&idx, arch_fd, newest) < 0) goto fail;
+                newest = e;
+            }
+            if (newest) plan.jobs[plan.count++] = newest;
+        }
+    } else {
+        for (size_t i = 0; i < nnames; i++) {
+            struct indexEntry *e = index_find(&idx, names[i]);
+            if (!e) {
+                printf("File '%s' not found in archive.\n", names[i]);
+                rc = 1;
+                continue;
+            }
+            size_t j = 0;
+            while (j < plan.count && plan.jobs[j] != e) j++;
+            if (j == plan.count) plan.jobs[plan.count++] = e;
+        }
+    }
+
+    if (plan.count > 0 && run_extract_phases(&plan, jobs) < 0) rc = -1;
+
+    /* cmd_compact checks again under its own lock before rewriting */
+    int due = compact_due(&idx, threshold);
+    free(plan.jobs);
+    pthread_mutex_destroy(&plan.lock);
+    index_free(&idx);
+    close(arch_fd);
+
+    if (due && cmd_compact(archive_name, threshold) < 0)
+        fprintf(stderr, "Warning: archive compaction failed.\n");
+    return rc;
+
+fail:
+    free(plan.jobs);
+    pthread_mutex_destroy(&plan.lock);
+    index_free(&idx);
+    close(arch_fd);
+    return -1;
+}
+
+/*
+ * Verification work item: one chunk of one member's stored payload. The
+ * first chunk of every member also checks the member header against the
+ * index; chunk CRCs are combined per member once all workers are done.
+ */
+struct verifyJob {
+    struct indexEntry *e;
+    off_t off;
+    off_t len;
+    uint32_t crc;
+    int failed;
+};
+
+struct verifyPlan {
+    int arch_fd;
+    const struct archIndex *idx;
+    struct verifyJob *jobs;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+};
+
+static void *verify_worker(void *arg) {
+    struct verifyPlan *plan = arg;
+
+    while (1) {
+        pthread_mutex_lock(&plan->lock);
+        size_t i = plan->next++;
+        pthread_mutex_unlock(&plan->lock);
+        if (i >= plan->count) break;
+
+        struct verifyJob *job = &plan->jobs[i];
+        const struct indexEntry *e = job->e;
+        if (job->off == entry_data(e)) {
+            struct memberHeader hdr;
+            uint32_t hdr_len;
+            /* tombstones are not compared, see mark_deleted */
+            if (header_read(plan->idx, plan->arch_fd, e->hdr_off, &hdr,
+                            &hdr_len) < 0 ||
+                hdr_len != e->hdr_len || hdr.size != e->size ||
+                hdr.stored != e->stored || hdr.crc != e->crc ||
+                hdr.data_off != e->data_off) {
+                job->failed = 1;
+                continue;
+            }
+        }
+        const unsigned char *data = archive_mapped(plan->idx, job->off,
+                                                   job->len);
+        job->crc = 0;
+        if (data)
+            job->crc = crc32c(0, data, (size_t)job->len);
+        else if (crc_range(plan->arch_fd, job->off, job->len, &job->crc,
+                           "Failed to read archive") < 0)
+            job->failed = 1;
+    }
+    return NULL;
+}
+
+/*
+ * Checks every live member: its header must agree with the index and the
+ * CRC-32C of its stored bytes must match. Payloads are split into
+ * VERIFY_CHUNK pieces hashed by `jobs` threads.
+ */
+static int cmd_verify(const char *archive_name, int jobs, int use_map) {
+    int arch_fd = archive_open(archive_name, O_RDONLY, LOCK_SH);
+    if (arch_fd < 0) {
+        perror("Failed to open archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(arch_fd, &idx, use_map) < 0) {
+        close(arch_fd);
+        return -1;
+    }
+
+    struct verifyPlan plan = {0};
+    plan.arch_fd = arch_fd;
+    plan.idx = &idx;
+    pthread_mutex_init(&plan.lock, NULL);
+    archive_advise(&idx, 0, (off_t)idx.map_len, MADV_SEQUENTIAL);
+
+    size_t cap = 0;
+    for (size_t i = 0; i < idx.count; i++) {
+        if (idx.ent[i].deleted) continue;
+        cap += (size_t)(idx.ent[i].stored / VERIFY_CHUNK) + 1;
+    }
+    plan.jobs = calloc(cap ? cap : 1, sizeof(*plan.jobs));
+    if (!plan.jobs) {
+        perror("verify: malloc");
+        pthread_mutex_destroy(&plan.lock);
+        index_free(&idx);
+        close(arch_fd);
+        return -1;
+    }
+    for (size_t i = 0; i < idx.count; i++) {
+        struct indexEntry *e = &idx.ent[i];
+        if (e->deleted) continue;
+        off_t off = entry_data(e), left = e->stored;
+        do {
+            struct verifyJob *job = &plan.jobs[plan.count++];
+            job->e = e;
+            job->off = off;
+            job->len = left > VERIFY_CHUNK ? VERIFY_CHUNK : left;
+            off += job->len;
+            left -= job->len;
+        } while (left > 0);
+    }
+
+    if (jobs > (int)plan.count) jobs = (int)plan.count;
+    run_workers(verify_worker, &plan, jobs);
+
+    size_t ok = 0, unchecked = 0, bad = 0;
+    off_t bytes = 0;
+    for (size_t j = 0; j < plan.count;) {
+        struct indexEntry *e = plan.jobs[j].e;
+        uint32_t crc = 0;
+        int failed = 0;
+        for (; j < plan.count && plan.jobs[j].e == e; j++) {
+            failed |= plan.jobs[j].failed;
+            crc = crc32c_combine(crc, plan.jobs[j].crc, (uint64_t)plan.jobs[j].len);
+        }
+        bytes += e->stored;
+        if (failed) {
+            fprintf(stderr, "'%s': unreadable or inconsistent member\n",
+                    entry_name(&idx, e));
+            bad++;
+        } else if (!(e->flags & HDR_HAS_CRC)) {
+            unchecked++;
+        } else if (crc != e->crc) {
+            fprintf(stderr, "'%s': checksum mismatch\n", entry_name(&idx, e));
+            bad++;
+        } else {
+            ok++;
+        }
+    }
+
+    printf("Verified %zu members (%lld bytes): %zu ok, %zu corrupt, "
+           "%zu without checksum.\n", ok + bad + unchecked, (long long)bytes,
+           ok, bad, unchecked);
+
+    free(plan.jobs);
+    pthread_mutex_destroy(&plan.lock);
+    index_free(&idx);
+    close(arch_fd);
+    return bad ? 1 : 0;
+}
+
+/*
+ * Random access to one member's contents. member_open resolves the member
+ * through the index and its header once; member_pread and member_send then
+ * go straight to the payload. Compressed members are entered by skipping
+ * whole blocks through their length prefixes (every block but the last
+ * holds LZ_BLOCK_SIZE bytes), and the last decoded block is kept for
+ * sequential reads. Range reads do not check the member checksum.
+ */
+struct memberReader {
+    const struct archIndex *idx;
+    int fd;
+    struct memberHeader hdr;
+    off_t data;
+    unsigned char *block;
+    unsigned char *zbuf;
+    off_t block_raw;
+    size_t block_len;
+    off_t next_pos;
+    off_t next_raw;
+};
+
+static int member_open(struct memberReader *r, const struct archIndex *idx,
+                       int fd, const char *name) {
+    memset(r, 0, sizeof(*r));
+    r->idx = idx;
+    r->fd = fd;
+    r->block_raw = -1;
+
+    const struct indexEntry *e = index_find((struct archIndex *)idx, name);
+    if (!e) {
+        fprintf(stderr, "File '%s' not found in archive.\n", name);
+        return -1;
+    }
+    uint32_t hdr_len;
+    if (header_read(idx, fd, e->hdr_off, &r->hdr, &hdr_len) < 0)
+        return -1;
+    if (r->hdr.size != e->size || r->hdr.stored != e->stored ||
+        r->hdr.data_off != e->data_off) {
+        fprintf(stderr, "Broken archive: index does not match header\n");
+        return -1;
+    }
+    if (S_ISDIR(r->hdr.mode)) {
+        fprintf(stderr, "'%s' is a directory\n", name);
+        return -1;
+    }
+    if (r->hdr.codec != CODEC_NONE && r->hdr.codec != CODEC_LZ) {
+        fprintf(stderr, "Unknown codec %u for '%s'\n", r->hdr.codec, name);
+        return -1;
+    }
+    r->data = entry_data(e);
+    r->next_pos = r->data;
+    return 0;
+}
+
+static void member_close(struct memberReader *r) {
+    free(r->block);
+    free(r->zbuf);
+    r->block = r->zbuf = NULL;
+}
+
+/* Decodes the LZ block holding raw offset `off` into r->block. */
+static int member_load_block(struct memberReader *r, off_t off) {
+    off_t end = r->data + r->hdr.stored;
+    unsigned char prefix[4];
+    uint32_t blk;
+
+    if (!r->block) r->block = malloc(LZ_BLOCK_SIZE);
+    if (!r->zbuf) r->zbuf = malloc(LZ_BOUND(LZ_BLOCK_SIZE));
+    if (!r->block || !r->zbuf) {
+        perror("cat: malloc");
+        return -1;
+    }
+    if (off < r->next_raw) {
+        /* going backwards: walk again from the first block */
+        r->next_pos = r->data;
+        r->next_raw = 0;
+    }
+    while (1) {
+        if (r->next_pos + (off_t)sizeof(prefix) > end ||
+            archive_read(r->idx, r->fd, prefix, sizeof(prefix), r->next_pos) !=
+                (ssize_t)sizeof(prefix)) {
+            fprintf(stderr, "Broken archive: truncated compressed block\n");
+            return -1;
+        }
+        blk = (uint32_t)le_get(prefix, sizeof(prefix));
+        size_t len = blk & ~LZ_RAW_BLOCK;
+        off_t payload = r->next_pos + (off_t)sizeof(blk);
+        if (len > LZ_BOUND(LZ_BLOCK_SIZE) || payload + (off_t)len > end) {
+            fprintf(stderr, "Broken archive: bad compressed block\n");
+            return -1;
+        }
+        if (off >= r->next_raw + LZ_BLOCK_SIZE) {
+            r->next_pos = payload + (off_t)len;
+            r->next_raw += LZ_BLOCK_SIZE;
+            continue;
+        }
+
+        long n;
+        if (blk & LZ_RAW_BLOCK) {
+            n = len <= LZ_BLOCK_SIZE &&
+                archive_read(r->idx, r->fd, r->block, len, payload) ==
+                    (ssize_t)len ? (long)len : -1;
+        } else {
+            n = archive_read(r->idx, r->fd, r->zbuf, len, payload) ==
+                    (ssize_t)len
+                ? lz_decompress(r->zbuf, len, r->block, LZ_BLOCK_SIZE) : -1;
+        }
+        if (n < 0) {
+            fprintf(stderr, "Broken archive: bad compressed block\n");
+            return -1;
+        }
+        r->block_raw = r->next_raw;
+        r->block_len = (size_t)n;
+        r->next_pos = payload + (off_t)len;
+        r->next_raw += LZ_BLOCK_SIZE;
+        return 0;
+    }
+}
+
+/* Reads up to `len` bytes of member contents at `off`; 0 at the end. */
+static ssize_t member_pread(struct memberReader *r, void *buf, size_t len,
+                            off_t off) {
+    if (off < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (off >= r->hdr.size) return 0;
+    if ((off_t)len > r->hdr.size - off) len = (size_t)(r->hdr.size - off);
+
+    if (r->hdr.codec == CODEC_NONE) {
+        ssize_t n = archive_read(r->idx, r->fd, buf, len, r->data + off);
+        if (n < 0) perror("cat: read");
+        return n;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        off_t at = off + (off_t)done;
+        if (r->block_raw < 0 || at < r->block_raw ||
+            at >= r->block_raw + (off_t)r->block_len) {
+            if (member_load_block(r, at) < 0) return -1;
+            if (at >= r->block_raw + (off_t)r->block_len) break;
+        }
+        size_t skip = (size_t)(at - r->block_raw);
+        size_t n = r->block_len - skip;
+        if (n > len - done) n = len - done;
+        memcpy((char *)buf + done, r->block + skip, n);
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+/*
+ * Streams `len` bytes of member contents from `off` to `out_fd` at its
+ * current position. Stored ranges move in the kernel: splice into a
+ * pipe, sendfile otherwise, with a read/write loop as the fallback.
+ * Returns the number of bytes written, or -1.
+ */
+static off_t member_send(struct memberReader *r, int out_fd, off_t off,
+                         off_t len) {
+    off_t done = 0;
+
+    if (off < 0 || off >= r->hdr.size || len <= 0) return 0;
+    if (len > r->hdr.size - off) len = r->hdr.size - off;
+
+    const unsigned char *data = r->hdr.codec == CODEC_NONE ?
+        archive_mapped(r->idx, r->data + off, len) : NULL;
+    if (data) {
+        if (full_write(out_fd, data, (size_t)len, "cat: write") < 0)
+            return -1;
+        return len;
+    }
+    if (r->hdr.codec == CODEC_NONE) {
+        struct stat st;
+        int pipe_out = fstat(out_fd, &st) == 0 && S_ISFIFO(st.st_mode);
+        loff_t in_off = r->data + off;
+        ssize_t n = 0;
+        while (done < len) {
+            size_t chunk = len - done > ZC_CHUNK ? ZC_CHUNK : (size_t)(len - done);
+            n = pipe_out
+                ? splice(r->fd, &in_off, out_fd, NULL, chunk, SPLICE_F_MORE)
+                : sendfile(out_fd, r->fd, &in_off, chunk);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done == len) return done;
+        /* anything but "not supported here" is a real error */
+        if (n < 0 && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            perror("cat: write");
+            return -1;
+        }
+    }
+
+    char *buf = malloc(BIG_BUF);
+    if (!buf) {
+        perror("cat: malloc");
+        return -1;
+    }
+    while (done < len) {
+        size_t want = len - done > BIG_BUF ? BIG_BUF : (size_t)(len - done);
+        ssize_t n = member_pread(r, buf, want, off + done);
+        if (n <= 0 || full_write(out_fd, buf, (size_t)n, "cat: write") < 0) {
+            if (n == 0) fprintf(stderr, "Broken archive: short member data\n");
+            free(buf);
+            return -1;
+        }
+        done += n;
+    }
+    free(buf);
+    return done;
+}
+
+/* Writes `length` bytes of a member from `offset` (-1 = to the end). */
+static int cmd_cat(const char *archive_name, const char *name, off_t offset,
+                   off_t length, int use_map) {
+    int arch_fd = archive_open(archive_name, O_RDONLY, LOCK_SH);
+    if (arch_fd < 0) {
+        perror("Failed to open archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(arch_fd, &idx, use_map) < 0) {
+        close(arch_fd);
+        return -1;
+    }
+
+    struct memberReader r;
+    int rc = -1;
+    if (member_open(&r, &idx, arch_fd, name) == 0) {
+        if (length < 0 || length > r.hdr.size) length = r.hdr.size;
+        archive_advise(&idx, r.data, r.hdr.stored, MADV_SEQUENTIAL);
+        if (member_send(&r, STDOUT_FILENO, offset, length) >= 0) rc = 0;
+        member_close(&r);
+    }
+    index_free(&idx);
+    close(arch_fd);
+    return rc;
+}
+
+static int cmd_stat(const char *archive_name, int use_map) {
+    int arch_fd = archive_open(archive_name, O_RDONLY, LOCK_SH);
+    if (arch_fd < 0) {
+        perror("Failed to open archive");
+        return -1;
+    }
+
+    struct archIndex idx;
+    if (index_load(arch_fd, &idx, use_map) < 0) {
+        close(arch_fd);
+        return -1;
+    }
+
+    printf("Archive '%s' contents:\n", archive_name);
+    printf("-----------------------------------------------------------------------\n");
+    printf("%-30s %-12s %-12s %-20s\n", "File name", "Size (B)", "Stored (B)",
+           "Modified");
+    printf("-----------------------------------------------------------------------\n");
+
+    for (size_t i = 0; i < idx.count; i++) {
+        const struct indexEntry *e = &idx.ent[i];
+        if (e->deleted) continue;
+
+        char tbuf[64];
+        time_t mtime = (time_t)e->mtime;
+        struct tm *tm = localtime(&mtime);
+        if (tm) strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", tm);
+        else strcpy(tbuf, "unknown");
+        printf("%-30s %-12lld %-12lld %-20s\n", entry_name(&idx, e),
+               (long long)e->size, (long long)e->stored, tbuf);
+    }
+
+    off_t live, dead;
+    index_usage(&idx, &live, &dead);
+    printf("-----------------------------------------------------------------------\n");
+    printf("Live bytes: %lld, dead bytes: %lld (%.1f%% reclaimable)\n",
+           (long long)live, (long long)dead,
+           live + dead ? 100.0 * (double)dead / (double)(live + dead) : 0.0);
+
+    /* logical: what extraction would produce; physical: the archive file */
+    off_t logical = 0;
+    size_t shared = 0;
+    struct stat st;
+    for (size_t i = 0; i < idx.count; i++) {
+        if (idx.ent[i].deleted) continue;
+        logical += idx.ent[i].size;
+        if (idx.ent[i].data_off) shared++;
+    }
+    printf("Logical bytes: %lld, physical bytes: %lld (%zu deduplicated members)\n",
+           (long long)logical,
+           fstat(arch_fd, &st) == 0 ? (long long)st.st_size : -1LL, shared);
+
+    index_free(&idx);
+    close(arch_fd);
+    return 0;
+}
+
+struct nameList {
+    char **items;
+    size_t count;
+    size_t cap;
+};
+
+static int list_push(struct nameList *l, const char *name) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        char **items = realloc(l->items, cap * sizeof(*items));
+        if (!items) {
+            perror("realloc");
+            return -1;
+        }
+        l->items = items;
+        l->cap = cap;
+    }
+    l->items[l->count] = strdup(name);
+    if (!l->items[l->count]) {
+        perror("strdup");
+        return -1;
+    }
+    l->count++;
+    return 0;
+}
+
+static void list_free(struct nameList *l) {
+    for (size_t i = 0; i < l->count; i++) free(l->items[i]);
+    free(l->items);
+}
+
+/* Reads one file name per line; "-" means standard input. */
+static int list_read(struct nameList *l, const char *list_name) {
+    FILE *f = strcmp(list_name, "-") == 0 ? stdin : fopen(list_name, "r");
+    if (!f) {
+        perror(list_name);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int rc = 0;
+    while ((n = getline(&line, &cap, f)) > 0) {
+        if (line[n - 1] == '\n') line[--n] = '\0';
+        if (n == 0) continue;
+        if (list_push(l, line) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+    free(line);
+    if (f != stdin) fclose(f);
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
         print_usage(argv[0]);
         return 1;
     }
@@ -391,22 +3528,171 @@ int main(int argc, char *argv[]) {
 
     static struct option long_opts[] = {
         {"input", required_argument, 0, 'i'},
+        {"files-from", required_argument, 0, 'T'},
+        {"recursive", required_argument, 0, 'r'},
+        {"compress", no_argument, 0, 'z'},
+        {"dedup", no_argument, 0, 'D'},
         {"extract", required_argument, 0, 'e'},
+        {"extract-all", no_argument, 0, 'x'},
+        {"jobs", required_argument, 0, 'j'},
+        {"io", required_argument, 0, 'I'},
+        {"mmap", no_argument, 0, 'm'},
+        {"cat", required_argument, 0, 'C'},
+        {"offset", required_argument, 0, 'o'},
+        {"length", required_argument, 0, 'l'},
         {"stat", no_argument, 0, 's'},
+        {"verify", no_argument, 0, 'V'},
+        {"compact", no_argument, 0, 'c'},
+        {"compact-threshold", required_argument, 0, 't'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
 
     optind = 2;
-    int opt, idx;
+    int opt, idx, rc;
+    int cmd = 0;
+    int codec = CODEC_NONE;
+    int use_map = 0;
+    int dedup = 0;
+    int io = -1;
+    const char *cat_name = NULL;
+    long long cat_off = 0, cat_len = -1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    double threshold = DEFAULT_COMPACT_THRESHOLD;
+    struct nameList names = {0};
+    struct nameList trees = {0};
+
+    while ((opt = getopt_long(argc, argv, "i:T:r:zDe:xj:I:mC:o:l:sVct:h", long_opts, &idx)) != -1) {
+        char *end;
+        switch (opt) {
+            case 'i':
+            case 'T':
+            case 'e':
+                if (cmd && cmd != (opt == 'e' ? 'e' : 'i')) goto fail;
+                cmd = (opt == 'e') ? 'e' : 'i';
+                if (opt == 'T' ? list_read(&names, optarg) < 0
+                               : list_push(&names, optarg) < 0)
+                    goto fail;
+                break;
+            case 'r':
+                if (cmd && cmd != 'i') goto fail;
+                cmd = 'i';
+                if (list_push(&trees, optarg) < 0) goto fail;
+                break;
+            case 'z':
+                codec = CODEC_LZ;
+                break;
+            case 'D':
+                dedup = 1;
+                break;
+            case 'm':
+                use_map = 1;
+                break;
+            case 'C':
+                if (cmd) goto fail;
+                cmd = 'C';
+                cat_name = optarg;
+                break;
+            case 'o':
+            case 'l': {
+                long long v = strtoll(optarg, &end, 10);
+                if (*end || v < 0) {
+                    fprintf(stderr, "Invalid %s '%s'\n",
+                            opt == 'o' ? "offset" : "length", optarg);
+                    goto fail;
+                }
+                if (opt == 'o') cat_off = v;
+                else cat_len = v;
+                break;
+            }
+            case 'x':
+            case 's':
+            case 'V':
+            case 'c':
+                if (cmd) goto fail;
+                cmd = opt;
+                break;
+            case 'j':
+                jobs = strtol(optarg, &end, 10);
+                if (*end || jobs < 1) {
+                    fprintf(stderr, "Invalid number of jobs '%s'\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'I':
+                if (strcmp(optarg, "uring") == 0) {
+                    io = IOB_URING;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    io = IOB_THREADS;
+                } else {
+                    fprintf(stderr, "Unknown I/O engine '%s'\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 't':
+                threshold = strtod(optarg, &end);
+                if (*end || threshold < 0) {
+                    fprintf(stderr, "Invalid compaction threshold '%s'\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'h':
+                list_free(&names);
+                list_free(&trees);
+                print_usage(argv[0]);
+                return 0;
+            default:
+                goto fail;
+        }
+    }
+    if (jobs < 1) jobs = 1;
 
-    opt = getopt_long(argc, argv, "i:e:sh", long_opts, &idx);
+    /* blocking I/O threads are cheap, so the pool never goes below a few */
+    struct ioEngine *eng = NULL;
+    if (io >= 0 && (cmd == 'i' || cmd == 'e' || cmd == 'x')) {
+        eng = iob_create(io, BATCH_DEPTH,
+                         jobs > BATCH_MIN_THREADS ? (int)jobs : BATCH_MIN_THREADS);
+        if (!eng)
+            fprintf(stderr, "Warning: cannot start the I/O engine, using plain I/O.\n");
+        else if (io == IOB_URING && strcmp(iob_backend_name(eng), "io_uring") != 0)
+            fprintf(stderr, "Note: io_uring is not available, using I/O threads.\n");
+    }
 
-    switch (opt) {
-        case 'i': return cmd_add(archive, optarg);
-        case 'e': return cmd_extract(archive, optarg);
-        case 's': return cmd_stat(archive);
-        case 'h': print_usage(argv[0]); return 0;
-        default:  print_usage(argv[0]); return 1;
+    switch (cmd) {
+        case 'i':
+            rc = cmd_add(archive, names.items, names.count, trees.items,
+                         trees.count, codec, dedup, eng);
+            break;
+        case 'e':
+        case 'x':
+            rc = cmd_extract(archive, names.items, names.count, cmd == 'x',
+                             (int)jobs, threshold, use_map, eng);
+            break;
+        case 'C':
+            rc = cmd_cat(archive, cat_name, (off_t)cat_off, (off_t)cat_len,
+                         use_map);
+            break;
+        case 's':
+            rc = cmd_stat(archive, use_map);
+            break;
+        case 'V':
+            rc = cmd_verify(archive, (int)jobs, use_map);
+            break;
+        case 'c':
+            rc = cmd_compact(archive, -1);
+            if (rc == 0) printf("Archive '%s' compacted.\n", archive);
+            break;
+        default:
+            goto fail;
     }
+    iob_destroy(eng);
+    list_free(&names);
+    list_free(&trees);
+    return rc;
+
+fail:
+    list_free(&names);
+    list_free(&trees);
+    print_usage(argv[0]);
+    return 1;
 }
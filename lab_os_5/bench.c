@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <ftw.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+
+/*
+ * Throughput benchmark for the archiver. Each corpus is generated once and
+ * then pushed through add, stat, extract and compact twice: a timed pass
+ * (wall time, peak RSS) and a traced pass that counts system calls with
+ * ptrace, so the tracing overhead never shows up in the timings.
+ */
+
+#define PATTERN_SIZE (1024 * 1024)
+#define PATTERN_CHUNK 4096
+#define FILES_PER_DIR 256
+#define MAX_SYSCALL 512
+#define TOP_SYSCALLS 3
+
+struct tier {
+    long count;
+    off_t min_size;
+    off_t max_size;
+};
+
+struct corpusSpec {
+    const char *name;
+    struct tier tiers[3];
+};
+
+static const struct corpusSpec corpora[] = {
+    {"small", {{20000, 512, 8 * 1024}}},
+    {"huge", {{4, 64LL << 20, 64LL << 20}}},
+    {"mixed", {{5000, 512, 16 * 1024}, {200, 64 * 1024, 1 << 20},
+               {2, 32LL << 20, 32LL << 20}}},
+};
+
+enum { OP_ADD, OP_STAT, OP_EXTRACT, OP_COMPACT, OP_COUNT };
+static const char *op_names[OP_COUNT] = {"add", "stat", "extract", "compact"};
+
+struct opResult {
+    double sec;
+    long maxrss_kb;
+    long long syscalls;
+    long long per_nr[MAX_SYSCALL];
+};
+
+struct benchConfig {
+    const char *archiver;
+    const char *workdir;
+    double scale;
+    int trace;
+    int keep;
+    char **extra;
+    int nextra;
+};
+
+static unsigned char pattern[PATTERN_SIZE];
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void) {
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+/* half random chunks, half text, so the LZ codec has something to do */
+static void pattern_init(void) {
+    static const char text[] =
+        "The quick brown fox jumps over the lazy dog while the archiver "
+        "streams members into the data region and rewrites the index. ";
+    for (size_t off = 0; off < PATTERN_SIZE; off += PATTERN_CHUNK) {
+        if (rng_next() & 1) {
+            for (size_t i = 0; i < PATTERN_CHUNK; i += 8) {
+                uint64_t v = rng_next();
+                memcpy(pattern + off + i, &v, 8);
+            }
+        } else {
+            for (size_t i = 0; i < PATTERN_CHUNK; i++)
+                pattern[off + i] = (unsigned char)text[i % (sizeof(text) - 1)];
+        }
+    }
+}
+
+static int write_file(const char *path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    size_t pos = rng_next() % PATTERN_SIZE;
+    while (size > 0) {
+        size_t n = PATTERN_SIZE - pos;
+        if ((off_t)n > size) n = (size_t)size;
+        ssize_t w = write(fd, pattern + pos, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        size -= w;
+        pos = (pos + (size_t)w) % PATTERN_SIZE;
+    }
+    return close(fd);
+}
+
+static long tier_count(const struct tier *t, double scale) {
+    long n = (long)((double)t->count * scale);
+    return (t->count > 0 && n < 1) ? 1 : n;
+}
+
+static int corpus_create(const struct corpusSpec *spec, double scale,
+                         long *files, long long *bytes) {
+    char path[PATH_MAX];
+    long seq = 0;
+
+    if (mkdir(spec->name, 0755) < 0) {
+        perror(spec->name);
+        return -1;
+    }
+    *files = 0;
+    *bytes = 0;
+    for (size_t t = 0; t < sizeof(spec->tiers) / sizeof(spec->tiers[0]); t++) {
+        const struct tier *tr = &spec->tiers[t];
+        long count = tier_count(tr, scale);
+        for (long i = 0; i < count; i++, seq++) {
+            if (seq % FILES_PER_DIR == 0) {
+                snprintf(path, sizeof(path), "%s/d%04ld", spec->name,
+                         seq / FILES_PER_DIR);
+                if (mkdir(path, 0755) < 0) {
+                    perror(path);
+                    return -1;
+                }
+            }
+            off_t size = tr->min_size;
+            if (tr->max_size > tr->min_size)
+                size += (off_t)(rng_next() % (uint64_t)(tr->max_size - tr->min_size + 1));
+            snprintf(path, sizeof(path), "%s/d%04ld/f%06ld", spec->name,
+                     seq / FILES_PER_DIR, seq);
+            if (write_file(path, size) < 0) return -1;
+            (*files)++;
+            *bytes += size;
+        }
+    }
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+                        struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if ((type == FTW_DP ? rmdir(path) : unlink(path)) < 0 && errno != ENOENT)
+        perror(path);
+    return 0;
+}
+
+static void remove_tree(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0) return;
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void child_exec(const char *dir, char **argv, int trace) {
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    if (chdir(dir) < 0) {
+        perror(dir);
+        _exit(127);
+    }
+    if (trace) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) {
+            perror("ptrace");
+            _exit(127);
+        }
+        raise(SIGSTOP);
+    }
+    execv(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+/*
+ * Follow the child and every thread it spawns, counting syscall entries by
+ * number. Returns the child's wait status, or -1 if tracing broke down.
+ */
+static int trace_child(pid_t pid, struct opResult *res) {
+    int status;
+    struct rusage ru;
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+    long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)opts) < 0 ||
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL) < 0) {
+        perror("ptrace");
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    for (;;) {
+        pid_t tid = wait4(-1, &status, __WALL, &ru);
+        if (tid < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid) {
+                res->maxrss_kb = ru.ru_maxrss;
+                return status;
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status)) continue;
+
+        int sig = WSTOPSIG(status);
+        int deliver = 0;
+        if (sig == (SIGTRAP | 0x80)) {
+            struct __ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, (void *)sizeof(info), &info) > 0 &&
+                info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+                res->syscalls++;
+                if (info.entry.nr < MAX_SYSCALL) res->per_nr[info.entry.nr]++;
+            }
+        } else if (sig != SIGTRAP && sig != SIGSTOP) {
+            deliver = sig;
+        } else if (sig == SIGSTOP && (status >> 16) == 0 && tid == pid) {
+            /* a real SIGSTOP sent to the archiver itself */
+            deliver = sig;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)deliver);
+    }
+}
+
+static int run_op(const struct benchConfig *cfg, const char *dir,
+                  char **argv, int trace, struct opResult *res) {
+    int status;
+    struct rusage ru;
+
+    memset(res, 0, sizeof(*res));
+    double start = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) child_exec(dir, argv, trace);
+
+    if (trace) {
+        status = trace_child(pid, res);
+        if (status == -1) {
+            fprintf(stderr, "bench: cannot trace %s, syscall counts disabled\n",
+                    cfg->archiver);
+            return -2;
+        }
+    } else {
+        while (wait4(pid, &status, 0, &ru) < 0) {
+            if (errno != EINTR) {
+                perror("wait4");
+                return -1;
+            }
+        }
+        res->maxrss_kb = ru.ru_maxrss;
+    }
+    res->sec = now_sec() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench: '%s %s %s' failed (status %d)\n", argv[0],
+                argv[1], argv[2], WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return -1;
+    }
+    return 0;
+}
+
+static const char *syscall_name(int nr) {
+    static char buf[16];
+    switch (nr) {
+        case SYS_read: return "read";
+        case SYS_write: return "write";
+        case SYS_pread64: return "pread64";
+        case SYS_pwrite64: return "pwrite64";
+        case SYS_readv: return "readv";
+        case SYS_writev: return "writev";
+        case SYS_openat: return "openat";
+        case SYS_close: return "close";
+        case SYS_fstat: return "fstat";
+        case SYS_newfstatat: return "newfstatat";
+        case SYS_lseek: return "lseek";
+        case SYS_mmap: return "mmap";
+        case SYS_munmap: return "munmap";
+        case SYS_madvise: return "madvise";
+        case SYS_sendfile: return "sendfile";
+        case SYS_splice: return "splice";
+        case SYS_copy_file_range: return "copy_file_range";
+        case SYS_getdents64: return "getdents64";
+        case SYS_fdatasync: return "fdatasync";
+        case SYS_fsync: return "fsync";
+        case SYS_ftruncate: return "ftruncate";
+        case SYS_chmod: return "chmod";
+        case SYS_fchmod: return "fchmod";
+        case SYS_fchown: return "fchown";
+        case SYS_utimensat: return "utimensat";
+        case SYS_mkdirat: return "mkdirat";
+        case SYS_futex: return "futex";
+        case SYS_flock: return "flock";
+        case SYS_brk: return "brk";
+    }
+    snprintf(buf, sizeof(buf), "#%d", nr);
+    return buf;
+}
+
+static void format_top(const struct opResult *res, char *out, size_t outsz) {
+    long long seen[TOP_SYSCALLS] = {0};
+    int nr[TOP_SYSCALLS];
+    size_t len = 0;
+
+    for (int i = 0; i < TOP_SYSCALLS; i++) {
+        nr[i] = -1;
+        for (int s = 0; s < MAX_SYSCALL; s++) {
+            int taken = 0;
+            for (int j = 0; j < i; j++)
+                if (nr[j] == s) taken = 1;
+            if (!taken && res->per_nr[s] > seen[i]) {
+                seen[i] = res->per_nr[s];
+                nr[i] = s;
+            }
+        }
+    }
+    out[0] = '\0';
+    for (int i = 0; i < TOP_SYSCALLS && nr[i] >= 0 && len < outsz; i++)
+        len += (size_t)snprintf(out + len, outsz - len, "%s%s:%lld",
+                                i ? " " : "", syscall_name(nr[i]), seen[i]);
+}
+
+static void build_argv(const struct benchConfig *cfg, const char *archive,
+                       int op, const char *corpus, char **argv) {
+    int n = 0;
+    argv[n++] = (char *)cfg->archiver;
+    argv[n++] = (char *)archive;
+    switch (op) {
+        case OP_ADD:
+            argv[n++] = "-r";
+            argv[n++] = (char *)corpus;
+            break;
+        case OP_STAT:
+            argv[n++] = "-s";
+            break;
+        case OP_EXTRACT:
+            /* extract tombstones the older copies; leave them for compact */
+            argv[n++] = "-x";
+            argv[n++] = "-t";
+            argv[n++] = "1";
+            break;
+        case OP_COMPACT:
+            argv[n++] = "-c";
+            break;
+    }
+    for (int i = 0; i < cfg->nextra; i++) argv[n++] = cfg->extra[i];
+    argv[n] = NULL;
+}
+
+/*
+ * One pass over a corpus: add it, list it, add it a second time (untimed),
+ * extract everything, which removes the first generation, and compact.
+ */
+static int run_pass(const struct benchConfig *cfg, const char *corpus,
+                    int trace, struct opResult *res, off_t *arch_size) {
+    char archive[PATH_MAX], outdir[PATH_MAX];
+    char *argv[16 + cfg->nextra];
+    struct opResult setup;
+    struct stat st;
+    int rc;
+
+    snprintf(archive, sizeof(archive), "%s/%s.arc", cfg->workdir, corpus);
+    snprintf(outdir, sizeof(outdir), "%s/%s.out", cfg->workdir, corpus);
+    unlink(archive);
+    remove_tree(outdir);
+    if (mkdir(outdir, 0755) < 0) {
+        perror(outdir);
+        return -1;
+    }
+
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (op == OP_EXTRACT) {
+            build_argv(cfg, archive, OP_ADD, corpus, argv);
+            if ((rc = run_op(cfg, cfg->workdir, argv, 0, &setup)) < 0) return rc;
+        }
+        build_argv(cfg, archive, op, corpus, argv);
+        rc = run_op(cfg, op == OP_EXTRACT ? outdir : cfg->workdir, argv,
+                    trace, &res[op]);
+        if (rc < 0) return rc;
+        if (op == OP_ADD && arch_size)
+            *arch_size = stat(archive, &st) == 0 ? st.st_size : 0;
+    }
+
+    if (!cfg->keep) {
+        unlink(archive);
+        remove_tree(outdir);
+    }
+    return 0;
+}
+
+static void print_result(const char *corpus, int op, long files,
+                         long long bytes, const struct opResult *timed,
+                         const struct opResult *traced) {
+    char mbs[16], fps[16], calls[24], top[96] = "";
+    double sec = timed->sec > 0 ? timed->sec : 1e-9;
+
+    if (op == OP_STAT)
+        snprintf(mbs, sizeof(mbs), "-");
+    else
+        snprintf(mbs, sizeof(mbs), "%.1f", (double)bytes / sec / 1e6);
+    snprintf(fps, sizeof(fps), "%.0f", (double)files / sec);
+    if (traced) {
+        snprintf(calls, sizeof(calls), "%lld", traced->syscalls);
+        format_top(traced, top, sizeof(top));
+    } else {
+        snprintf(calls, sizeof(calls), "-");
+    }
+    printf("%-7s %-8s %9.3f %9s %10s %10s %9ld  %s\n", corpus, op_names[op],
+           timed->sec, mbs, fps, calls, timed->maxrss_kb, top);
+}
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [options] <archiver> <workdir>\n", prog);
+    printf("Options:\n");
+    printf("  -c, --corpus <name>   Run only this corpus (small, huge, mixed;\n");
+    printf("                        may be repeated)\n");
+    printf("  -s, --scale <factor>  Multiply the number of files per corpus\n");
+    printf("                        (default 1.0)\n");
+    printf("  -n, --no-trace        Skip the traced pass (no syscall counts)\n");
+    printf("  -k, --keep            Keep corpora, archives and extracted trees\n");
+    printf("  -X, --archiver-arg <arg>\n");
+    printf("                        Pass <arg> to every archiver run (may be\n");
+    printf("                        repeated, e.g. -X -z or -X -m)\n");
+    printf("  -h, --help            Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_opts[] = {
+        {"corpus", required_argument, 0, 'c'},
+        {"scale", required_argument, 0, 's'},
+        {"no-trace", no_argument, 0, 'n'},
+        {"keep", no_argument, 0, 'k'},
+        {"archiver-arg", required_argument, 0, 'X'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    struct benchConfig cfg = {0};
+    const size_t ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+    int selected[sizeof(corpora) / sizeof(corpora[0])] = {0};
+    int any_selected = 0;
+    char *extra[argc];
+    char workdir[PATH_MAX], archiver[PATH_MAX];
+    int opt;
+
+    cfg.scale = 1.0;
+    cfg.trace = 1;
+    cfg.extra = extra;
+
+    while ((opt = getopt_long(argc, argv, "+c:s:nkX:h", long_opts, NULL)) != -1) {
+        char *end;
+        size_t i;
+        switch (opt) {
+            case 'c':
+                for (i = 0; i < ncorpora && strcmp(corpora[i].name, optarg); i++)
+                    ;
+                if (i == ncorpora) {
+                    fprintf(stderr, "Unknown corpus '%s'\n", optarg);
+                    return 1;
+                }
+                selected[i] = any_selected = 1;
+                break;
+            case 's':
+                cfg.scale = strtod(optarg, &end);
+                if (*end || cfg.scale <= 0) {
+                    fprintf(stderr, "Invalid scale '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                cfg.trace = 0;
+                break;
+            case 'k':
+                cfg.keep = 1;
+                break;
+            case 'X':
+                extra[cfg.nextra++] = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!realpath(argv[optind], archiver)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    mkdir(argv[optind + 1], 0755);
+    if (!realpath(argv[optind + 1], workdir) || chdir(workdir) < 0) {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    cfg.archiver = archiver;
+    cfg.workdir = workdir;
+    pattern_init();
+
+    printf("%-7s %-8s %9s %9s %10s %10s %9s  %s\n", "corpus", "op", "sec",
+           "MB/s", "files/s", "syscalls", "maxrssKB", "top syscalls");
+
+    int rc = 0;
+    for (size_t c = 0; c < ncorpora; c++) {
+        const char *name = corpora[c].name;
+        struct opResult timed[OP_COUNT], traced[OP_COUNT];
+        long files;
+        long long bytes;
+        off_t arch_size = 0;
+        int have_trace = 0;
+
+        if (any_selected && !selected[c]) continue;
+        remove_tree(name);
+        if (corpus_create(&corpora[c], cfg.scale, &files, &bytes) < 0 ||
+            run_pass(&cfg, name, 0, timed, &arch_size) < 0) {
+            rc = 1;
+            remove_tree(name);
+            continue;
+        }
+        if (cfg.trace) {
+            int trc = run_pass(&cfg, name, 1, traced, NULL);
+            if (trc == -2) cfg.trace = 0;
+            else if (trc < 0) rc = 1;
+            else have_trace = 1;
+        }
+
+        printf("# %s: %ld files, %.1f MB, archive %.1f MB after add\n", name,
+               files, (double)bytes / 1e6, (double)arch_size / 1e6);
+        for (int op = 0; op < OP_COUNT; op++)
+            print_result(name, op, files, bytes, &timed[op],
+                         have_trace ? &traced[op] : NULL);
+        fflush(stdout);
+        if (!cfg.keep) remove_tree(name);
+    }
+    return rc;
+}
@@ -0,0 +1,237 @@
+#!/bin/sh
+#
+# Functional checks for the archiver, run by `make check`:
+# add/extract/verify/cat round trips in every storage mode, baseline v1
+# archives, and members that must not be extracted outside the current
+# directory. Usage: check.sh [archiver] (default ./archiver).
+
+ARCHIVER=$(cd "$(dirname "${1:-./archiver}")" && pwd)/$(basename "${1:-./archiver}")
+CC=${CC:-gcc}
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/archiver-check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+failed=0
+total=0
+
+check() {
+    desc=$1
+    shift
+    total=$((total + 1))
+    if "$@" >"$work/log" 2>&1; then
+        echo "PASS  $desc"
+    else
+        echo "FAIL  $desc"
+        sed 's/^/      /' "$work/log"
+        failed=$((failed + 1))
+    fi
+}
+
+# Runs the archiver in directory $1 with the remaining arguments.
+arc() {
+    (cd "$1" && shift && "$ARCHIVER" "$@")
+}
+
+# Same files, contents, modes and link targets under both trees.
+same_tree() {
+    (cd "$1" && find . -printf '%y %m %p %l\n' | sort) >"$work/tree.a" &&
+    (cd "$2" && find . -printf '%y %m %p %l\n' | sort) >"$work/tree.b" &&
+    diff "$work/tree.a" "$work/tree.b" &&
+    diff -r --no-dereference "$1" "$2"
+}
+
+# ---- source tree --------------------------------------------------------
+
+src=$work/src
+mkdir -p "$src/tree/a/b" "$src/tree/empty"
+printf 'hello\n' >"$src/tree/a/hello.txt"
+: >"$src/tree/a/zero"
+i=0
+while [ $i -lt 40 ]; do
+    printf 'small file %d\n' $i >"$src/tree/a/b/f$i"
+    i=$((i + 1))
+done
+# past the in-kernel copy threshold and several LZ blocks, compressible
+yes 'the quick brown fox jumps over the lazy dog' | head -c 3000000 \
+    >"$src/tree/a/big.txt"
+head -c 600000 /dev/urandom >"$src/tree/a/random.bin"
+cp "$src/tree/a/hello.txt" "$src/tree/a/b/dup.txt"
+chmod 600 "$src/tree/a/b/f3"
+chmod 750 "$src/tree/a/b"
+ln "$src/tree/a/hello.txt" "$src/tree/hardlink"
+ln -s a/hello.txt "$src/tree/symlink"
+printf 'single\n' >"$src/single"
+
+# ---- round trips --------------------------------------------------------
+
+# round_trip <name> <add options> <extract options>
+round_trip() {
+    dir=$work/rt-$1
+    mkdir -p "$dir/out"
+    arc "$src" "$dir/t.arch" $2 -r tree -i single >/dev/null || return 1
+    arc "$dir" t.arch -V || return 1
+    arc "$dir" t.arch -C tree/a/big.txt | cmp - "$src/tree/a/big.txt" ||
+        return 1
+    arc "$dir" t.arch -C tree/a/random.bin -o 100000 -l 70000 |
+        cmp - "$work/range" || return 1
+    arc "$dir/out" ../t.arch -x $3 >/dev/null || return 1
+    same_tree "$src/tree" "$dir/out/tree" || return 1
+    cmp "$src/single" "$dir/out/single" || return 1
+    [ "$(stat -c %i "$dir/out/tree/hardlink")" = \
+      "$(stat -c %i "$dir/out/tree/a/hello.txt")" ] || return 1
+    # every member was moved out, so compaction left an empty archive
+    [ "$(arc "$dir" t.arch -s | grep -c '^tree/')" -eq 0 ]
+}
+
+tail -c +100001 "$src/tree/a/random.bin" | head -c 70000 >"$work/range"
+check "round trip, stored" round_trip plain "" ""
+check "round trip, compressed (-z)" round_trip lz -z ""
+check "round trip, compressed and deduplicated (-z -D)" \
+    round_trip dedup "-z -D" ""
+check "round trip, thread I/O engine (-I threads)" \
+    round_trip threads "-I threads" "-I threads -j 1"
+check "round trip, memory-mapped reads (-m)" round_trip mmap "" "-m -j 4"
+
+extract_one() {
+    dir=$work/one
+    mkdir -p "$dir/out"
+    arc "$src" "$dir/t.arch" -i single -r tree >/dev/null &&
+    arc "$dir/out" ../t.arch -e single >/dev/null &&
+    cmp "$src/single" "$dir/out/single" &&
+    ! arc "$dir" t.arch -s | grep -q '^single ' &&
+    arc "$dir" t.arch -C tree/a/hello.txt | cmp - "$src/tree/a/hello.txt" &&
+    arc "$dir" t.arch -c >/dev/null &&
+    arc "$dir" t.arch -V
+}
+check "extract one member, list, cat and compact the rest" extract_one
+
+verify_corrupt() {
+    dir=$work/corrupt
+    mkdir -p "$dir"
+    printf 'payload to be damaged\n' >"$dir/victim"
+    arc "$dir" t.arch -i victim >/dev/null &&
+    arc "$dir" t.arch -V >/dev/null &&
+    off=$(grep -abo 'to be damaged' "$dir/t.arch" | cut -d: -f1) &&
+    printf 'X' | dd of="$dir/t.arch" bs=1 seek="$off" conv=notrunc \
+        2>/dev/null &&
+    ! arc "$dir" t.arch -V
+}
+check "verify reports a corrupted payload" verify_corrupt
+
+# ---- baseline v1 archives -----------------------------------------------
+
+# Writes [struct fileInput][payload] records exactly as the original
+# archiver did: v1gen <archive> <name> <contents> ...
+cat >"$work/v1gen.c" <<'EOF'
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_LIMIT 256
+
+struct fileInput {
+    char  name[NAME_LIMIT];
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    off_t size;
+    time_t atime;
+    time_t mtime;
+    char deleted;
+};
+
+int main(int argc, char *argv[]) {
+    FILE *f = fopen(argv[1], "wb");
+    if (!f) return 1;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        struct fileInput fi;
+        memset(&fi, 0, sizeof(fi));
+        strncpy(fi.name, argv[i], NAME_LIMIT - 1);
+        fi.mode = 0100644;
+        fi.uid = getuid();
+        fi.gid = getgid();
+        fi.size = (off_t)strlen(argv[i + 1]);
+        fi.atime = fi.mtime = 1000000000;
+        fwrite(&fi, sizeof(fi), 1, f);
+        fwrite(argv[i + 1], 1, strlen(argv[i + 1]), f);
+    }
+    return fclose(f) != 0;
+}
+EOF
+if ! $CC -o "$work/v1gen" "$work/v1gen.c"; then
+    echo "cannot build the v1 archive writer" >&2
+    exit 1
+fi
+
+v1_read() {
+    dir=$work/v1
+    mkdir -p "$dir/out"
+    "$work/v1gen" "$dir/v1.arch" one 'first member
+' two 'second member
+' &&
+    arc "$dir" v1.arch -s | grep -q '^two ' &&
+    arc "$dir" v1.arch -V | grep -q '2 without checksum' &&
+    [ "$(arc "$dir" v1.arch -C one)" = "first member" ] &&
+    arc "$dir/out" ../v1.arch -e two >/dev/null &&
+    [ "$(cat "$dir/out/two")" = "second member" ] &&
+    ! arc "$dir" v1.arch -s | grep -q '^two '
+}
+check "v1 archive: list, verify, cat and extract" v1_read
+
+v1_upgrade() {
+    dir=$work/v1up
+    mkdir -p "$dir/out"
+    "$work/v1gen" "$dir/v1.arch" one 'first member
+' &&
+    ! arc "$src" "$dir/v1.arch" -i single &&
+    arc "$dir" v1.arch -c >/dev/null &&
+    arc "$src" "$dir/v1.arch" -i single -z >/dev/null &&
+    arc "$dir" v1.arch -V | grep -q '2 ok' &&
+    arc "$dir/out" ../v1.arch -x >/dev/null &&
+    [ "$(cat "$dir/out/one")" = "first member" ] &&
+    cmp "$src/single" "$dir/out/single"
+}
+check "v1 archive: add refused until compacted to v4" v1_upgrade
+
+# ---- unsafe member names ------------------------------------------------
+
+dotdot() {
+    dir=$work/dotdot
+    mkdir -p "$dir/a/out"
+    "$work/v1gen" "$dir/a/bad.arch" ../escaped 'outside' \
+        'x/../../escaped2' 'outside' &&
+    ! arc "$dir/a/out" ../bad.arch -x &&
+    [ ! -e "$dir/a/escaped" ] && [ ! -e "$dir/escaped2" ] &&
+    ! arc "$src" "$dir/a/t.arch" -i ../src/single
+}
+check "members with '..' are refused on add and extract" dotdot
+
+absolute() {
+    dir=$work/abs
+    mkdir -p "$dir/out" "$dir/out2"
+    arc "$dir" t.arch -i "$src/single" 2>/dev/null >/dev/null &&
+    arc "$dir/out" ../t.arch -x >/dev/null &&
+    cmp "$src/single" "$dir/out/${src#/}/single" &&
+    "$work/v1gen" "$dir/v1.arch" /abs/name 'rooted' &&
+    arc "$dir/out2" ../v1.arch -x >/dev/null &&
+    [ "$(cat "$dir/out2/abs/name")" = "rooted" ]
+}
+check "leading '/' is stripped on add and extract" absolute
+
+symlink_escape() {
+    dir=$work/escape
+    mkdir -p "$dir/s1/top" "$dir/s2/top/d" "$dir/victim" "$dir/out"
+    ln -s "$dir/victim" "$dir/s1/top/d"
+    printf 'owned\n' >"$dir/s2/top/d/passwd"
+    arc "$dir/s1" ../e1.arch -r top >/dev/null &&
+    arc "$dir/s2" ../e2.arch -r top >/dev/null &&
+    arc "$dir/out" ../e1.arch -x >/dev/null &&
+    ! arc "$dir/out" ../e2.arch -x &&
+    [ -z "$(ls -A "$dir/victim")" ]
+}
+check "extraction never writes through an extracted symlink" symlink_escape
+
+echo "$((total - failed)) of $total checks passed"
+[ $failed -eq 0 ]
@@ -0,0 +1,128 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC 1
+#endif
+
+#define POLY 0x82f63b78u
+
+static uint32_t table[8][256];
+static uint32_t x2n_table[32];
+static int use_hw;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static uint32_t multmodp(uint32_t a, uint32_t b);
+
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+        table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = table[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = table[0][c & 0xff] ^ (c >> 8);
+            table[k][n] = c;
+        }
+    }
+    uint32_t q = 1u << 30;
+    for (int i = 0; i < 32; i++) {
+        x2n_table[i] = q;
+        q = multmodp(q, q);
+    }
+#ifdef HAVE_SSE42_CRC
+    __builtin_cpu_init();
+    use_hw = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+#else
+    use_hw = 0;
+#endif
+}
+
+/* slicing-by-8 */
+static uint32_t crc32c_sw(uint32_t c, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        w ^= c;
+        c = table[7][w & 0xff] ^ table[6][(w >> 8) & 0xff] ^
+            table[5][(w >> 16) & 0xff] ^ table[4][(w >> 24) & 0xff] ^
+            table[3][(w >> 32) & 0xff] ^ table[2][(w >> 40) & 0xff] ^
+            table[1][(w >> 48) & 0xff] ^ table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#ifdef HAVE_SSE42_CRC
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t c, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t c64 = c;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        c64 = _mm_crc32_u64(c64, w);
+        p += 8;
+        len -= 8;
+    }
+    c = (uint32_t)c64;
+#endif
+    while (len--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    crc = ~crc;
+#ifdef HAVE_SSE42_CRC
+    if (use_hw) return ~crc32c_hw(crc, buf, len);
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
+
+/* a * b modulo the CRC polynomial (bit-reflected) */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return p;
+}
+
+/* x^(n * 2^k) modulo the CRC polynomial */
+static uint32_t x2nmodp(uint64_t n, unsigned k) {
+    uint32_t p = 1u << 31;
+
+    pthread_once(&init_once, crc32c_init);
+    while (n) {
+        if (n & 1) p = multmodp(x2n_table[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b) {
+    return multmodp(x2nmodp(len_b, 3), crc_a) ^ crc_b;
+}
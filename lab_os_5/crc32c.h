@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli). Same calling convention as zlib's crc32():
+ * start with 0 and feed the data in any number of pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* CRC of A followed by B, given crc(A), crc(B) and the length of B. */
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+#endif
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "iobatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define STAGE_OPEN  0
+#define STAGE_XFER  1
+#define STAGE_CLOSE 2
+
+/* per-job bookkeeping while its open/transfer/close chain is in flight */
+struct jobState {
+    int open_res;
+    int xfer_res;
+    int close_res;
+    unsigned slot;
+    unsigned pending;
+};
+
+struct ioEngine {
+    int backend;
+
+    /* io_uring: rings mapped from the kernel, one file slot per job */
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned slots;
+    unsigned *free_slots;
+    struct jobState *state;
+    size_t state_cap;
+
+    /* thread pool: workers pull job numbers from a shared counter */
+    pthread_t *tids;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, idle;
+    struct ioJob *jobs;
+    size_t count, next, done;
+    int stop;
+};
+
+static int sys_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned submit, unsigned wait,
+                           unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_uring_register(int fd, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static void uring_teardown(struct ioEngine *eng) {
+    if (eng->sqes && eng->sqes != MAP_FAILED) munmap(eng->sqes, eng->sqes_sz);
+    if (eng->cq_ring && eng->cq_ring != MAP_FAILED && eng->cq_ring != eng->sq_ring)
+        munmap(eng->cq_ring, eng->cq_ring_sz);
+    if (eng->sq_ring && eng->sq_ring != MAP_FAILED)
+        munmap(eng->sq_ring, eng->sq_ring_sz);
+    if (eng->ring_fd >= 0) close(eng->ring_fd);
+    eng->ring_fd = -1;
+    eng->sq_ring = eng->cq_ring = NULL;
+    eng->sqes = NULL;
+    free(eng->free_slots);
+    free(eng->state);
+    eng->free_slots = NULL;
+    eng->state = NULL;
+}
+
+/*
+ * Sets up the rings and a sparse table of `depth` registered files.
+ * Direct opens into that table need Linux 5.15; IORING_FEAT_CQE_SKIP
+ * (5.17) is the closest feature bit that proves it is there.
+ */
+static int uring_init(struct ioEngine *eng, unsigned depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    eng->ring_fd = sys_uring_setup(depth * 3, &p);
+    if (eng->ring_fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_CQE_SKIP))
+        goto fail;
+
+    eng->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    eng->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (eng->cq_ring_sz > eng->sq_ring_sz) eng->sq_ring_sz = eng->cq_ring_sz;
+    eng->sq_ring = mmap(NULL, eng->sq_ring_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, eng->ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (eng->sq_ring == MAP_FAILED) goto fail;
+    eng->cq_ring = eng->sq_ring;
+    eng->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    eng->sqes = mmap(NULL, eng->sqes_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, eng->ring_fd, IORING_OFF_SQES);
+    if (eng->sqes == MAP_FAILED) goto fail;
+
+    char *sq = eng->sq_ring, *cq = eng->cq_ring;
+    eng->sq_head = (unsigned *)(sq + p.sq_off.head);
+    eng->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    eng->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    eng->sq_array = (unsigned *)(sq + p.sq_off.array);
+    eng->sq_entries = p.sq_entries;
+    eng->cq_head = (unsigned *)(cq + p.cq_off.head);
+    eng->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    eng->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    eng->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    eng->slots = p.sq_entries / 3;
+    if (eng->slots > depth) eng->slots = depth;
+    eng->free_slots = malloc(eng->slots * sizeof(*eng->free_slots));
+    int *fds = malloc(eng->slots * sizeof(*fds));
+    if (!eng->free_slots || !fds) {
+        free(fds);
+        goto fail;
+    }
+    for (unsigned i = 0; i < eng->slots; i++) fds[i] = -1;
+    int r = sys_uring_register(eng->ring_fd, IORING_REGISTER_FILES, fds,
+                               eng->slots);
+    free(fds);
+    if (r < 0) goto fail;
+    return 0;
+
+fail:
+    uring_teardown(eng);
+    return -1;
+}
+
+static struct io_uring_sqe *uring_sqe(struct ioEngine *eng, unsigned *tail) {
+    struct io_uring_sqe *sqe = &eng->sqes[*tail & *eng->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    eng->sq_array[*tail & *eng->sq_mask] = *tail & *eng->sq_mask;
+    (*tail)++;
+    return sqe;
+}
+
+/* Queues open -> read/write -> close for job `i` on file slot `slot`. */
+static void uring_queue_job(struct ioEngine *eng, const struct ioJob *job,
+                            size_t i, unsigned slot, unsigned *tail) {
+    struct io_uring_sqe *sqe = uring_sqe(eng, tail);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = job->dir_fd;
+    sqe->addr = (uintptr_t)job->path;
+    sqe->open_flags = (uint32_t)job->flags;
+    sqe->len = job->mode;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uint64_t)i << 2 | STAGE_OPEN;
+
+    /* a hard link, so the slot is closed even after a failed transfer */
+    sqe = uring_sqe(eng, tail);
+    sqe->opcode = job->op == IOB_LOAD ? IORING_OP_READ : IORING_OP_WRITE;
+    sqe->fd = (int)slot;
+    sqe->addr = (uintptr_t)job->buf;
+    sqe->len = (uint32_t)job->len;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->user_data = (uint64_t)i << 2 | STAGE_XFER;
+
+    sqe = uring_sqe(eng, tail);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = (uint64_t)i << 2 | STAGE_CLOSE;
+}
+
+static int uring_run(struct ioEngine *eng, struct ioJob *jobs, size_t n) {
+    if (n > eng->state_cap) {
+        struct jobState *s = realloc(eng->state, n * sizeof(*s));
+        if (!s) return -1;
+        eng->state = s;
+        eng->state_cap = n;
+    }
+    unsigned nfree = eng->slots;
+    for (unsigned i = 0; i < nfree; i++) eng->free_slots[i] = i;
+
+    size_t next = 0, done = 0;
+    while (done < n) {
+        unsigned tail = *eng->sq_tail;
+        unsigned head = __atomic_load_n(eng->sq_head, __ATOMIC_ACQUIRE);
+        while (next < n && nfree > 0 && eng->sq_entries - (tail - head) >= 3) {
+            struct jobState *s = &eng->state[next];
+            if (jobs[next].len > INT_MAX) {
+                /* a completion can only report up to INT_MAX bytes */
+                jobs[next].result = -EFBIG;
+                s->pending = 0;
+                next++;
+                done++;
+                continue;
+            }
+            s->slot = eng->free_slots[--nfree];
+            s->pending = 3;
+            s->open_res = s->xfer_res = s->close_res = 0;
+            uring_queue_job(eng, &jobs[next], next, s->slot, &tail);
+            next++;
+        }
+        __atomic_store_n(eng->sq_tail, tail, __ATOMIC_RELEASE);
+        if (done == n) break;
+
+        unsigned submit = tail - __atomic_load_n(eng->sq_head, __ATOMIC_ACQUIRE);
+        if (sys_uring_enter(eng->ring_fd, submit, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+
+        unsigned chead = *eng->cq_head;
+        unsigned ctail = __atomic_load_n(eng->cq_tail, __ATOMIC_ACQUIRE);
+        for (; chead != ctail; chead++) {
+            const struct io_uring_cqe *cqe = &eng->cqes[chead & *eng->cq_mask];
+            size_t i = (size_t)(cqe->user_data >> 2);
+            struct jobState *s = &eng->state[i];
+            switch (cqe->user_data & 3) {
+                case STAGE_OPEN: s->open_res = cqe->res; break;
+                case STAGE_XFER: s->xfer_res = cqe->res; break;
+                default: s->close_res = cqe->res; break;
+            }
+            if (--s->pending > 0) continue;
+
+            if (s->open_res < 0)
+                jobs[i].result = s->open_res;
+            else if (s->xfer_res < 0)
+                jobs[i].result = s->xfer_res;
+            else if (s->close_res < 0)
+                jobs[i].result = s->close_res;
+            else
+                jobs[i].result = s->xfer_res;
+            eng->free_slots[nfree++] = s->slot;
+            done++;
+        }
+        __atomic_store_n(eng->cq_head, chead, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static ssize_t run_job_sync(const struct ioJob *job) {
+    int fd = openat(job->dir_fd, job->path, job->flags | O_CLOEXEC, job->mode);
+    if (fd < 0) return -errno;
+
+    size_t done = 0;
+    ssize_t res = 0;
+    while (done < job->len) {
+        char *p = (char *)job->buf + done;
+        ssize_t r = job->op == IOB_LOAD ? read(fd, p, job->len - done)
+                                        : write(fd, p, job->len - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            res = -errno;
+            break;
+        }
+        if (r == 0) break;
+        done += (size_t)r;
+    }
+    if (close(fd) < 0 && res == 0) res = -errno;
+    return res < 0 ? res : (ssize_t)done;
+}
+
+static void *pool_worker(void *arg) {
+    struct ioEngine *eng = arg;
+
+    pthread_mutex_lock(&eng->lock);
+    while (1) {
+        while (!eng->stop && eng->next >= eng->count)
+            pthread_cond_wait(&eng->work, &eng->lock);
+        if (eng->stop) break;
+        struct ioJob *job = &eng->jobs[eng->next++];
+        pthread_mutex_unlock(&eng->lock);
+
+        job->result = run_job_sync(job);
+
+        pthread_mutex_lock(&eng->lock);
+        if (++eng->done == eng->count) pthread_cond_signal(&eng->idle);
+    }
+    pthread_mutex_unlock(&eng->lock);
+    return NULL;
+}
+
+static int pool_init(struct ioEngine *eng, int threads) {
+    pthread_mutex_init(&eng->lock, NULL);
+    pthread_cond_init(&eng->work, NULL);
+    pthread_cond_init(&eng->idle, NULL);
+    eng->tids = malloc((size_t)threads * sizeof(*eng->tids));
+    if (!eng->tids) return -1;
+    for (; eng->nthreads < threads; eng->nthreads++) {
+        if (pthread_create(&eng->tids[eng->nthreads], NULL, pool_worker, eng) != 0)
+            break;
+    }
+    return 0;
+}
+
+static int pool_run(struct ioEngine *eng, struct ioJob *jobs, size_t n) {
+    if (eng->nthreads == 0) {
+        for (size_t i = 0; i < n; i++) jobs[i].result = run_job_sync(&jobs[i]);
+        return 0;
+    }
+    pthread_mutex_lock(&eng->lock);
+    eng->jobs = jobs;
+    eng->count = n;
+    eng->next = eng->done = 0;
+    pthread_cond_broadcast(&eng->work);
+    while (eng->done < eng->count) pthread_cond_wait(&eng->idle, &eng->lock);
+    eng->count = eng->next = 0;
+    pthread_mutex_unlock(&eng->lock);
+    return 0;
+}
+
+/*
+ * Creates an engine on `backend`; io_uring falls back to a pool of
+ * `threads` workers when the kernel does not offer what it needs.
+ */
+struct ioEngine *iob_create(int backend, unsigned depth, int threads) {
+    struct ioEngine *eng = calloc(1, sizeof(*eng));
+    if (!eng) return NULL;
+    eng->ring_fd = -1;
+    if (depth < 1) depth = 1;
+    if (threads < 1) threads = 1;
+
+    if (backend == IOB_URING && uring_init(eng, depth) == 0) {
+        eng->backend = IOB_URING;
+        return eng;
+    }
+    eng->backend = IOB_THREADS;
+    if (pool_init(eng, threads) < 0) {
+        iob_destroy(eng);
+        return NULL;
+    }
+    return eng;
+}
+
+void iob_destroy(struct ioEngine *eng) {
+    if (!eng) return;
+    if (eng->backend == IOB_URING) {
+        uring_teardown(eng);
+    } else {
+        pthread_mutex_lock(&eng->lock);
+        eng->stop = 1;
+        pthread_cond_broadcast(&eng->work);
+        pthread_mutex_unlock(&eng->lock);
+        for (int i = 0; i < eng->nthreads; i++) pthread_join(eng->tids[i], NULL);
+        free(eng->tids);
+        pthread_mutex_destroy(&eng->lock);
+        pthread_cond_destroy(&eng->work);
+        pthread_cond_destroy(&eng->idle);
+    }
+    free(eng);
+}
+
+/* Runs every job; returns -1 only if the engine itself failed. */
+int iob_run(struct ioEngine *eng, struct ioJob *jobs, size_t n) {
+    if (n == 0) return 0;
+    return eng->backend == IOB_URING ? uring_run(eng, jobs, n)
+                                     : pool_run(eng, jobs, n);
+}
+
+const char *iob_backend_name(const struct ioEngine *eng) {
+    return eng->backend == IOB_URING ? "io_uring" : "threads";
+}
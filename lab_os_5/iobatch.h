@@ -0,0 +1,41 @@
+#ifndef IOBATCH_H
+#define IOBATCH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define IOB_LOAD  0
+#define IOB_STORE 1
+
+#define IOB_URING   0
+#define IOB_THREADS 1
+
+/*
+ * One whole-file transfer: open `path` (relative to `dir_fd`), read or
+ * write `len` bytes of `buf` at offset 0, close. `result` receives the
+ * byte count or a negative errno.
+ */
+struct ioJob {
+    int op;
+    int dir_fd;
+    const char *path;
+    int flags;
+    mode_t mode;
+    void *buf;
+    size_t len;
+    ssize_t result;
+};
+
+/*
+ * Runs batches of ioJobs with many transfers in flight: on io_uring each
+ * job is a linked open/read-or-write/close chain on a registered file slot,
+ * elsewhere a small thread pool does the same with plain syscalls.
+ */
+struct ioEngine;
+
+struct ioEngine *iob_create(int backend, unsigned depth, int threads);
+void iob_destroy(struct ioEngine *eng);
+int iob_run(struct ioEngine *eng, struct ioJob *jobs, size_t n);
+const char *iob_backend_name(const struct ioEngine *eng);
+
+#endif
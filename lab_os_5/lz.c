@@ -0,0 +1,135 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define HASH_LOG 14
+#define MAX_OFFSET 65535
+
+static uint32_t hash4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned char *oend,
+                                 size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *lit, size_t nlit,
+                                   size_t offset, size_t mlen) {
+    if (op >= oend) return NULL;
+    unsigned char *token = op++;
+    *token = (unsigned char)((nlit >= 15 ? 15 : nlit) << 4);
+    if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    mlen -= MIN_MATCH;
+    *token |= (unsigned char)(mlen >= 15 ? 15 : mlen);
+    if (mlen >= 15 && !(op = put_length(op, oend, mlen - 15))) return NULL;
+    return op;
+}
+
+/* Returns the compressed size, or 0 if the result does not fit in `cap`. */
+size_t lz_compress(const unsigned char *src, size_t n,
+                   unsigned char *dst, size_t cap) {
+    uint32_t table[1 << HASH_LOG];
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (n >= MIN_MATCH && ip <= end - MIN_MATCH) {
+        uint32_t h = hash4(ip);
+        const unsigned char *ref = src + table[h];
+        table[h] = (uint32_t)(ip - src);
+
+        if (ref >= ip || ip - ref > MAX_OFFSET || memcmp(ref, ip, MIN_MATCH) != 0) {
+            /* skip faster through data that does not compress */
+            size_t step = 1 + (misses++ >> 6);
+            if ((size_t)(end - ip) < step + MIN_MATCH) break;
+            ip += step;
+            continue;
+        }
+        misses = 0;
+
+        const unsigned char *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+        while (m < end && *m == *r) {
+            m++;
+            r++;
+        }
+        op = put_sequence(op, oend, anchor, (size_t)(ip - anchor),
+                          (size_t)(ip - ref), (size_t)(m - ip));
+        if (!op) return 0;
+        ip = anchor = m;
+    }
+
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *iend,
+                      size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Returns the decompressed size, or -1 if the block is malformed. */
+long lz_decompress(const unsigned char *src, size_t n,
+                   unsigned char *dst, size_t cap) {
+    const unsigned char *ip = src, *iend = src + n;
+    unsigned char *op = dst, *oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_length(&ip, iend, &nlit) < 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) < 0) return -1;
+        mlen += MIN_MATCH;
+        if ((size_t)(oend - op) < mlen) return -1;
+
+        const unsigned char *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return (long)(op - dst);
+}
@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+#define LZ_BLOCK_SIZE (64 * 1024)
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+/*
+ * LZ77 block codec in the spirit of LZ4: a block is a sequence of
+ * (token, literals, 16-bit offset, match length) records and is always
+ * decoded on its own, so blocks can be streamed one at a time.
+ */
+size_t lz_compress(const unsigned char *src, size_t n,
+                   unsigned char *dst, size_t cap);
+long lz_decompress(const unsigned char *src, size_t n,
+                   unsigned char *dst, size_t cap);
+
+#endif
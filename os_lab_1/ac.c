@@ -0,0 +1,130 @@
+#include "ac.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The trie is turned into a complete DFA: every state has a transition for
+ * every input class, failure links are folded in at build time, and the
+ * scan does one table lookup per byte. Bytes that occur in no pattern all
+ * share class 0, which keeps the table at states x (distinct bytes + 1)
+ * entries instead of states x 256.
+ */
+struct ac {
+    uint32_t *delta;
+    unsigned char *accept;
+    size_t ncls;
+    uint16_t cls[256];
+    unsigned char start[256];   /* first bytes of the patterns */
+    int one_start;              /* the only first byte, or -1 */
+};
+
+struct ac *ac_build(const char *const *pats, const size_t *lens, size_t n) {
+    struct ac *a = calloc(1, sizeof(*a));
+    if (!a) return NULL;
+
+    size_t total = 1, nstart = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += lens[i];
+        for (size_t k = 0; k < lens[i]; k++) {
+            unsigned char b = (unsigned char)pats[i][k];
+            if (!a->cls[b]) a->cls[b] = (uint16_t)++a->ncls;
+        }
+        unsigned char f = (unsigned char)pats[i][0];
+        if (!a->start[f]) {
+            a->start[f] = 1;
+            a->one_start = f;
+            nstart++;
+        }
+    }
+    if (nstart != 1) a->one_start = -1;
+    a->ncls++;
+
+    size_t nc = a->ncls;
+    uint32_t *fail = malloc(total * sizeof(*fail));
+    uint32_t *queue = malloc(total * sizeof(*queue));
+    a->delta = malloc(total * nc * sizeof(*a->delta));
+    a->accept = calloc(total, 1);
+    if (!fail || !queue || !a->delta || !a->accept) {
+        free(fail);
+        free(queue);
+        ac_free(a);
+        return NULL;
+    }
+
+    /* the trie, with 0 standing for a missing child (the root is no child) */
+    size_t nstates = 1;
+    memset(a->delta, 0, nc * sizeof(*a->delta));
+    for (size_t i = 0; i < n; i++) {
+        uint32_t s = 0;
+        for (size_t k = 0; k < lens[i]; k++) {
+            unsigned char b = (unsigned char)pats[i][k];
+            uint32_t *t = &a->delta[s * nc + a->cls[b]];
+            if (!*t) {
+                memset(&a->delta[nstates * nc], 0, nc * sizeof(*a->delta));
+                *t = (uint32_t)nstates++;
+            }
+            s = *t;
+        }
+        a->accept[s] = 1;
+    }
+
+    /* breadth first, so a state's failure target is complete before it */
+    size_t qh = 0, qt = 0;
+    for (size_t c = 0; c < nc; c++) {
+        uint32_t v = a->delta[c];
+        if (v) {
+            fail[v] = 0;
+            queue[qt++] = v;
+        }
+    }
+    while (qh < qt) {
+        uint32_t u = queue[qh++];
+        for (size_t c = 0; c < nc; c++) {
+            uint32_t *t = &a->delta[u * nc + c];
+            uint32_t f = a->delta[fail[u] * nc + c];
+            if (*t) {
+                fail[*t] = f;
+                a->accept[*t] |= a->accept[f];
+                queue[qt++] = *t;
+            } else {
+                *t = f;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return a;
+}
+
+const char *ac_find(const struct ac *a, const char *hay, size_t n) {
+    const unsigned char *p = (const unsigned char *)hay;
+    const unsigned char *end = p + n;
+    const uint32_t *delta = a->delta;
+    size_t nc = a->ncls;
+    uint32_t s = 0;
+
+    while (p < end) {
+        /* most text never leaves the root: skip to a possible first byte */
+        if (s == 0) {
+            if (a->one_start >= 0) {
+                p = memchr(p, a->one_start, (size_t)(end - p));
+                if (!p) return NULL;
+            } else {
+                while (p < end && !a->start[*p]) p++;
+                if (p == end) return NULL;
+            }
+        }
+        s = delta[s * nc + a->cls[*p]];
+        if (a->accept[s]) return (const char *)p;
+        p++;
+    }
+    return NULL;
+}
+
+void ac_free(struct ac *a) {
+    if (!a) return;
+    free(a->delta);
+    free(a->accept);
+    free(a);
+}
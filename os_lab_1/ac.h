@@ -0,0 +1,23 @@
+#ifndef AC_H
+#define AC_H
+
+#include <stddef.h>
+
+/* Aho-Corasick automaton over a set of literal patterns. */
+struct ac;
+
+/*
+ * Builds the automaton for pats[i][0..lens[i]), i < n. Patterns must not
+ * be empty. Returns NULL when out of memory.
+ */
+struct ac *ac_build(const char *const *pats, const size_t *lens, size_t n);
+
+/*
+ * Scans hay[0..n) once and returns a pointer to the last byte of the
+ * first occurrence of any pattern (the one that ends earliest), or NULL.
+ */
+const char *ac_find(const struct ac *a, const char *hay, size_t n);
+
+void ac_free(struct ac *a);
+
+#endif
@@ -0,0 +1,130 @@
+#!/bin/sh
+#
+# Functional checks for mygrep, run by `make check`: every option is run
+# over small fixed files and its output compared with fixed text, the
+# lines grep prints. The exit status is 1 after an error and otherwise 0,
+# except with -q, where 1 means that nothing matched.
+# Usage: check.sh [mygrep] (default ./mygrep).
+
+MYGREP=$(cd "$(dirname "${1:-./mygrep}")" && pwd)/$(basename "${1:-./mygrep}")
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/mygrep-check.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+failed=0
+total=0
+
+# expect <description> <status> <expected output> <mygrep arguments...>
+# runs in $work, so file names in the output are relative
+expect() {
+    desc=$1 status=$2 want=$3
+    shift 3
+    total=$((total + 1))
+    got=$(cd "$work" && "$MYGREP" "$@" 2>&1)
+    rc=$?
+    if [ "$rc" -eq "$status" ] && [ "$got" = "$want" ]; then
+        echo "PASS  $desc"
+    else
+        echo "FAIL  $desc (mygrep $*)"
+        echo "      exit status $rc, expected $status"
+        printf '%s\n' "$want" >"$work/want"
+        printf '%s\n' "$got" >"$work/got"
+        diff "$work/want" "$work/got" | sed 's/^/      /'
+        failed=$((failed + 1))
+    fi
+}
+
+cat >"$work/log1" <<'EOF'
+alpha beta
+gamma
+delta alpha
+error: disk full
+warning: low memory
+alphabet soup
+EOF
+cat >"$work/log2" <<'EOF'
+nothing here
+ERROR upper case
+error: again
+alpha
+EOF
+printf 'no newline at the end: alpha' >"$work/log3"
+printf 'alpha\nerror\n' >"$work/pats"
+printf '^[a-z]+:\nsoup$\n' >"$work/eres"
+
+# ---- fixed strings ------------------------------------------------------
+
+expect "literal, one file" 0 "alpha beta
+delta alpha
+alphabet soup" alpha log1
+
+expect "literal, file names with several files" 0 "log1:error: disk full
+log2:error: again" error log1 log2
+
+expect "last line without a newline" 0 "log3:no newline at the end: alpha
+log1:alpha beta" -m 1 alpha log3 log1
+
+expect "no match" 0 "" omega log1 log2
+
+expect "-e twice" 0 "gamma
+warning: low memory" -e gamma -e low log1
+
+expect "-f file" 0 "alpha beta
+delta alpha
+error: disk full
+alphabet soup" -f pats log1
+
+expect "-f and -e together" 0 "nothing here
+error: again
+alpha" -f pats -e nothing log2
+
+# ---- extended regular expressions ---------------------------------------
+
+expect "-E alternation and groups" 0 "gamma
+delta alpha" -E '^(gam|del)(ma|ta)' log1
+
+expect "-E anchors and classes" 0 "error: disk full
+warning: low memory" -E '^[[:alpha:]]+: [a-z]{3,4} ' log1
+
+expect "-E repetition" 0 "alphabet soup" -E '(al)?pha(bet)+ s.u*p$' log1
+
+expect "-E with -f" 0 "error: disk full
+warning: low memory
+alphabet soup" -E -f eres log1
+
+expect "-E bad pattern" 1 "mygrep: unmatched (" -E '(alpha' log1
+
+# ---- -c, -l, -q, -m -----------------------------------------------------
+
+expect "-c" 0 "log1:3
+log2:1
+log3:1" -c alpha log1 log2 log3
+
+expect "-c with no match" 0 "0" -c omega log1
+
+expect "-c -m" 0 "log1:2
+log2:1" -c -m 2 alpha log1 log2
+
+expect "-m" 0 "alpha beta" -m 1 alpha log1
+
+expect "-m 0" 0 "" -m 0 alpha log1
+
+expect "-l" 0 "log1
+log2" -l error log1 log2 log3
+
+expect "-q match" 0 "" -q memory log2 log1
+
+expect "-q no match" 1 "" -q omega log1 log2
+
+expect "-c in operand order with -j" 0 "log1:3
+log2:1
+log3:1
+log1:3" -j 4 -c alpha log1 log2 log3 log1
+
+expect "-l in operand order with -j" 0 "log2
+log1" -j 4 -l error log2 log3 log1
+
+expect "missing file named in the error" 1 "mygrep: nosuch: No such file or directory
+log1:alpha beta" -m 1 alpha nosuch log1
+
+echo "$((total - failed)) of $total checks passed"
+[ $failed -eq 0 ]
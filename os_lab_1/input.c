@@ -0,0 +1,161 @@
+#define _POSIX_C_SOURCE 200809L
+#include "input.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define HAVE_MMAP 1
+#endif
+
+int buf_reserve(struct buf *b, size_t need) {
+    if (need <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < need) cap *= 2;
+    char *p = realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+int buf_append(struct buf *b, const char *p, size_t n) {
+    if (buf_reserve(b, b->len + n) < 0) return -1;
+    if (n) memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+void buf_free(struct buf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = b->cap = 0;
+}
+
+int input_open(struct input *in, const char *path) {
+    memset(in, 0, sizeof(*in));
+    in->f = path ? fopen(path, "r") : stdin;
+    if (!in->f) return -1;
+
+#ifdef HAVE_MMAP
+    struct stat st;
+    /* small files are cheaper to read than to map and unmap */
+    if (fstat(fileno(in->f), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= INPUT_MAP_MIN && (uintmax_t)st.st_size <= SIZE_MAX) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                       fileno(in->f), 0);
+        if (p != MAP_FAILED) {
+            posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            in->map = p;
+            in->map_len = (size_t)st.st_size;
+        }
+    }
+#endif
+    return 0;
+}
+
+/* Reads what is available, so lines from a slow pipe are not held back. */
+static size_t read_some(FILE *f, char *p, size_t n, int *err) {
+#ifdef HAVE_MMAP
+    while (1) {
+        ssize_t r = read(fileno(f), p, n);
+        if (r >= 0) return (size_t)r;
+        if (errno != EINTR) {
+            *err = 1;
+            return 0;
+        }
+    }
+#else
+    size_t r = fread(p, 1, n, f);
+    if (r == 0 && ferror(f)) *err = 1;
+    return r;
+#endif
+}
+
+/* Whether a read would return data right away. */
+static int more_ready(FILE *f) {
+#ifdef HAVE_MMAP
+    struct pollfd pfd = { fileno(f), POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+#else
+    (void)f;
+    return 0;
+#endif
+}
+
+int input_next(struct input *in, size_t want, struct buf *own,
+               const char **data, size_t *len) {
+    if (in->map) {
+        if (in->pos >= in->map_len) return 0;
+        size_t end = in->map_len;
+        if (want < in->map_len - in->pos) {
+            const char *nl = memchr(in->map + in->pos + want, '\n',
+                                    in->map_len - in->pos - want);
+            if (nl) end = (size_t)(nl - in->map) + 1;
+        }
+        *data = in->map + in->pos;
+        *len = end - in->pos;
+        in->pos = end;
+        return 1;
+    }
+
+    own->len = 0;
+    if (in->eof && in->carry.len == 0) return 0;
+    if (buf_reserve(own, want) < 0 ||
+        buf_append(own, in->carry.data, in->carry.len) < 0)
+        return -1;
+    in->carry.len = 0;
+
+    /*
+     * A line longer than the buffer makes the buffer grow. Once a line is
+     * complete the block is handed out, unless it is still small and more
+     * input is already waiting: a fast writer then gets searched in blocks
+     * of at least INPUT_STREAM_MIN, a slow one line by line as it writes.
+     */
+    size_t scanned = 0, lines = 0;
+    while (!in->eof) {
+        if (own->len == own->cap && buf_reserve(own, own->cap * 2) < 0)
+            return -1;
+        int err = 0;
+        size_t got = read_some(in->f, own->data + own->len,
+                               own->cap - own->len, &err);
+        if (err) return -1;
+        if (got == 0) {
+            in->eof = 1;
+            break;
+        }
+        own->len += got;
+
+        size_t i = own->len;
+        while (i > scanned && own->data[i - 1] != '\n') i--;
+        scanned = own->len;
+        if (i > 0 && own->data[i - 1] == '\n') lines = i;
+        if (lines > 0 && (own->len >= INPUT_STREAM_MIN ||
+                          own->len == own->cap || !more_ready(in->f)))
+            break;
+    }
+    if (!in->eof && lines > 0) {
+        if (buf_append(&in->carry, own->data + lines, own->len - lines) < 0)
+            return -1;
+        own->len = lines;
+    }
+    if (own->len == 0) return 0;
+    *data = own->data;
+    *len = own->len;
+    return 1;
+}
+
+void input_close(struct input *in) {
+#ifdef HAVE_MMAP
+    if (in->map) munmap((void *)in->map, in->map_len);
+#endif
+    if (in->f && in->f != stdin) fclose(in->f);
+    buf_free(&in->carry);
+    in->map = NULL;
+    in->f = NULL;
+}
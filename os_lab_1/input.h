@@ -0,0 +1,50 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define INPUT_BLOCK (4 * 1024 * 1024)
+#define INPUT_MAP_MIN (64 * 1024)
+#define INPUT_STREAM_MIN (256 * 1024)
+
+/* Growable byte buffer. */
+struct buf {
+    char  *data;
+    size_t len;
+    size_t cap;
+};
+
+int buf_reserve(struct buf *b, size_t need);
+int buf_append(struct buf *b, const char *p, size_t n);
+void buf_free(struct buf *b);
+
+/*
+ * Input read in blocks of whole lines. Regular files are mapped and their
+ * blocks point into the mapping; pipes and terminals are read through a
+ * large buffer instead of line by line.
+ */
+struct input {
+    FILE *f;
+    const char *map;
+    size_t map_len;
+    size_t pos;
+    struct buf carry;
+    int eof;
+};
+
+/* Opens `path`, or standard input when it is NULL. */
+int input_open(struct input *in, const char *path);
+
+/*
+ * Returns the next block of about `want` bytes that ends at a line break
+ * (only the last line of the input may lack one) in *data and *len. Blocks
+ * that had to be copied live in `own`, which the caller keeps. Returns 1
+ * for a block, 0 at the end, -1 on read errors.
+ */
+int input_next(struct input *in, size_t want, struct buf *own,
+               const char **data, size_t *len);
+
+void input_close(struct input *in);
+
+#endif
@@ -25,6 +25,7 @@ int main(int argc, char *argv[]) {
     fprintf(stderr,
         "Usage:\n"
         "  mycat [-n] [-b] [-E] [files...]\n"
-        "  mygrep pattern [file]\n");
+        "  mygrep [-j N] [-r] [-E] [-c|-l|-q] [-m N] "
+        "[-e pattern]... [-f file]... [pattern] [file...]\n");
     return 1;
 }
@@ -1,32 +1,65 @@
 #include "mycat.h"
+#include "input.h"
+#include "output.h"
 #include <stdio.h>
 #include <string.h>
 
-static int print_file(FILE *f, int n_flag, int b_flag, int e_flag) {
-    char line[4096];
-    int line_num = 1;
-    while (fgets(line, sizeof(line), f)) {
-        int print_num = 0;
+static int print_file(struct input *in, struct output *out,
+                      int n_flag, int b_flag, int e_flag) {
+    struct buf own = {0};
+    const char *data;
+    size_t len;
+    uint64_t line_num = 1;
+    int r;
 
-        if (b_flag) {
-            if (!(line[0] == '\n' && line[1] == '\0')) print_num = 1;
-        } else if (n_flag) {
-            print_num = 1;
+    /* nothing to change: let the kernel move the bytes */
+    if (!n_flag && !b_flag && !e_flag) {
+        r = out_copy(out, in->f);
+        if (r < 0) {
+            perror("mycat");
+            return 1;
         }
+        if (r > 0) return 0;
+    }
 
-        if (print_num) {
-            printf("%6d\t", line_num++);
+    while ((r = input_next(in, INPUT_BLOCK, &own, &data, &len)) > 0) {
+        if (!n_flag && !b_flag && !e_flag) {
+            out_write(out, data, len);
+            out_block_end(out);
+            continue;
         }
+        const char *p = data, *end = data + len;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+            int print_num = 0;
 
-        size_t len = strlen(line);
-        if (len && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-            if (e_flag) printf("%s$\n", line);
-            else        printf("%s\n",  line);
-        } else {
-            if (e_flag) printf("%s$", line);
-            else        printf("%s",  line);
+            if (b_flag) {
+                if (n != 0) print_num = 1;
+            } else if (n_flag) {
+                print_num = 1;
+            }
+
+            if (print_num) {
+                out_num(out, line_num++, 6);
+                out_byte(out, '\t');
+            }
+
+            out_write(out, p, n);
+            if (e_flag) out_byte(out, '$');
+            if (nl) {
+                out_byte(out, '\n');
+                p = nl + 1;
+            } else {
+                p = end;
+            }
         }
+        out_block_end(out);
+    }
+    buf_free(&own);
+    if (r < 0) {
+        perror("mycat");
+        return 1;
     }
     return 0;
 }
@@ -46,18 +79,28 @@ int mycat_run(int argc, char *argv[]) {
             break;
         }
     }
+    struct input in;
+    struct output out;
+    int rc = 0;
+    out_init(&out, 1);
     if (first_file == -1) {
-        return print_file(stdin, n_flag, b_flag, e_flag);
+        input_open(&in, NULL);
+        rc = print_file(&in, &out, n_flag, b_flag, e_flag);
+        input_close(&in);
     }
-    for (int i = first_file; i < argc; ++i) {
+    for (int i = first_file; first_file != -1 && i < argc; ++i) {
         const char *path = argv[i];
-        FILE *f = fopen(path, "r");
-        if (!f) {
+        if (input_open(&in, path) < 0) {
             perror(path);
             continue; 
         }
-        print_file(f, n_flag, b_flag, e_flag);
-        fclose(f);
+        print_file(&in, &out, n_flag, b_flag, e_flag);
+        input_close(&in);
     }
-    return 0;
+    if (out_flush(&out) < 0) {
+        perror("mycat: write error");
+        rc = 1;
+    }
+    out_close(&out);
+    return rc;
 }
@@ -1,31 +1,1006 @@
+#define _GNU_SOURCE
 #include "mygrep.h"
+#include "ac.h"
+#include "input.h"
+#include "output.h"
+#include "regex.h"
+#include "search.h"
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-int mygrep_run(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: mygrep pattern [file]\n");
+#ifndef _WIN32
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_THREADS 1
+#endif
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mygrep [-j N] [-r] [-E] [-c|-l|-q] [-m N] "
+                    "[-e pattern]... [-f file]... [pattern] [file...]\n");
+}
+
+/* Reports a failed operation on `path` as grep does, from errno. */
+static void file_error(const char *path) {
+    fprintf(stderr, "mygrep: %s: %s\n", path, strerror(errno));
+}
+
+/*
+ * What a matching line contains: one literal, found with the SIMD kernel,
+ * any of a set, found in a single pass with an Aho-Corasick automaton, or
+ * with -E a match of any of the patterns as regular expressions. An empty
+ * literal matches every line; an empty set matches none.
+ */
+struct matcher {
+    const char *lit;
+    size_t lit_len;
+    struct ac *ac;
+    struct regex *re;
+};
+
+/* `dfa` is the calling thread's state cache for mt->re. */
+static const char *match_find(const struct matcher *mt, struct dfa *dfa,
+                              const char *p, size_t n) {
+    if (mt->re) return regex_find(dfa, p, n);
+    if (mt->ac) return ac_find(mt->ac, p, n);
+    if (!mt->lit) return NULL;
+    return search_find(p, n, mt->lit, mt->lit_len);
+}
+
+/*
+ * Patterns are the lines of `text`, each ending with '\n'. Returns -1
+ * and sets *err on failure.
+ */
+static int matcher_init(struct matcher *mt, const char *text, size_t len,
+                        int extended, const char **err) {
+    const char **pats = NULL;
+    size_t *lens = NULL;
+    size_t n = 0;
+
+    memset(mt, 0, sizeof(*mt));
+    *err = "out of memory";
+    for (size_t k = 0; k < len; k++) n += text[k] == '\n';
+    if (n == 0) return 0;
+    pats = malloc(n * sizeof(*pats));
+    lens = malloc(n * sizeof(*lens));
+    if (!pats || !lens) {
+        free(pats);
+        free(lens);
+        return -1;
+    }
+    n = 0;
+    for (const char *p = text, *end = text + len; p < end; ) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        pats[n] = p;
+        lens[n] = (size_t)(nl - p);
+        if (lens[n] == 0 && !extended) {
+            mt->lit = p;
+            break;
+        }
+        n++;
+        p = nl + 1;
+    }
+    if (extended) {
+        mt->re = regex_compile(pats, lens, n, err);
+    } else if (!mt->lit && n == 1) {
+        mt->lit = pats[0];
+        mt->lit_len = lens[0];
+    } else if (!mt->lit) {
+        mt->ac = ac_build(pats, lens, n);
+    }
+    free(pats);
+    free(lens);
+    return mt->lit || mt->ac || mt->re ? 0 : -1;
+}
+
+/* What is printed for the matching lines of a file. */
+enum { REPORT_LINES, REPORT_COUNT, REPORT_FILES, REPORT_QUIET };
+
+struct report {
+    int mode;
+    long max;           /* -m: matching lines per file, < 0 for all */
+    int matched;        /* set once any file had a matching line */
+    struct output *out;
+};
+
+/* How many matching lines of a file are worth looking for. */
+static long report_limit(const struct report *rp) {
+    if (rp->mode == REPORT_FILES || rp->mode == REPORT_QUIET)
+        return rp->max == 0 ? 0 : 1;
+    return rp->max;
+}
+
+/* Adds what -c or -l print for a file with `count` matching lines. */
+static int report_file(struct report *rp, const char *name, int names,
+                       long count, struct buf *out) {
+    char num[32];
+
+    if (count > 0) __atomic_store_n(&rp->matched, 1, __ATOMIC_RELAXED);
+    if (rp->mode == REPORT_COUNT) {
+        int k = snprintf(num, sizeof(num), "%ld\n", count);
+        if (names && (buf_append(out, name, strlen(name)) < 0 ||
+                      buf_append(out, ":", 1) < 0))
+            return -1;
+        return buf_append(out, num, (size_t)k);
+    }
+    if (rp->mode == REPORT_FILES && count > 0) {
+        if (buf_append(out, name, strlen(name)) < 0) return -1;
+        return buf_append(out, "\n", 1);
+    }
+    return 0;
+}
+
+/*
+ * Finds the lines of `in` that match `mt`, at most `max` of them unless
+ * max is negative, and returns how many, or -1 when out of memory. Only
+ * when `out` is given are the lines themselves looked at: they are
+ * copied there, each preceded by `pre` (a file name and a colon, or
+ * nothing). Lines end with '\n'; the last one may not, and gets one only
+ * when a prefix is printed, so that the next file starts on a line of
+ * its own.
+ */
+static long scan_chunk(const char *in, size_t n, const struct matcher *mt,
+                       struct dfa *dfa, long max, const char *pre,
+                       size_t pre_len, struct buf *out) {
+    const char *p = in, *end = in + n;
+    long count = 0;
+
+    if (mt->re && !dfa) return -1;
+    if (!out && max < 0 && mt->lit && mt->lit_len == 0) {
+        /* every line matches: just count them */
+        if (n == 0) return 0;
+        return (long)search_count(in, n, '\n') + (in[n - 1] != '\n');
+    }
+    while (p < end && count != max) {
+        const char *hit = match_find(mt, dfa, p, (size_t)(end - p));
+        if (!hit) break;
+        const char *nl = memchr(hit, '\n', (size_t)(end - hit));
+        const char *stop = nl ? nl + 1 : end;
+        count++;
+        if (out) {
+            const char *start = hit;
+            while (start > p && start[-1] != '\n') start--;
+            if (buf_append(out, pre, pre_len) < 0 ||
+                buf_append(out, start, (size_t)(stop - start)) < 0)
+                return -1;
+            if (!nl && pre_len && buf_append(out, "\n", 1) < 0) return -1;
+        }
+        p = stop;
+    }
+    return count;
+}
+
+/*
+ * Searches one input. `name` is what -l and -c print for it, and file
+ * name prefixes are printed when `names` is set.
+ */
+static int grep_seq(struct input *in, const struct matcher *mt,
+                    struct report *rp, const char *name, int names) {
+    struct buf own = {0}, out = {0}, pre = {0};
+    struct dfa *dfa = mt->re ? dfa_new(mt->re) : NULL;
+    int lines = rp->mode == REPORT_LINES;
+    long max = report_limit(rp), total = 0;
+    const char *data;
+    size_t len;
+    int r = 0, rc = 0;
+
+    if (lines && names && (buf_append(&pre, name, strlen(name)) < 0 ||
+                           buf_append(&pre, ":", 1) < 0)) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        rc = 1;
+        max = 0;
+    }
+    /* stop reading as soon as the limit is reached */
+    while (total != max &&
+           (r = input_next(in, INPUT_BLOCK, &own, &data, &len)) > 0) {
+        out.len = 0;
+        long k = scan_chunk(data, len, mt, dfa, max < 0 ? -1 : max - total,
+                            pre.data, pre.len, lines ? &out : NULL);
+        if (k < 0) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            rc = 1;
+            break;
+        }
+        total += k;
+        out_write(rp->out, out.data, out.len);
+        out_block_end(rp->out);
+    }
+    if (r < 0) {
+        file_error(name);
+        rc = 1;
+    }
+    out.len = 0;
+    if (report_file(rp, name, names, total, &out) < 0) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        rc = 1;
+    }
+    out_write(rp->out, out.data, out.len);
+    buf_free(&own);
+    buf_free(&out);
+    buf_free(&pre);
+    dfa_free(dfa);
+    return rc;
+}
+
+#ifdef HAVE_THREADS
+
+/*
+ * Parallel scan: the main thread cuts the input into newline-aligned
+ * chunks and writes the results; workers search chunks as they come. A
+ * chunk with sequence number k lives in slot k % nslots, so matches are
+ * written in input order. Chunks of a mapped file point into the mapping.
+ * Workers find at most the -m limit of matches per chunk; the main thread
+ * trims the total and stops reading once the limit is reached.
+ */
+enum { SLOT_FREE, SLOT_READY, SLOT_DONE };
+
+struct slot {
+    struct buf in;
+    const char *data;
+    size_t len;
+    struct buf out;
+    long count;
+    int state;
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct slot *slots;
+    size_t nslots;
+    size_t filled;
+    size_t next;
+    int stop;
+    const struct matcher *mt;
+    long max;
+    int lines;
+};
+
+static void *worker(void *arg) {
+    struct pool *pl = arg;
+    struct dfa *dfa = pl->mt->re ? dfa_new(pl->mt->re) : NULL;
+
+    pthread_mutex_lock(&pl->lock);
+    while (1) {
+        while (!pl->stop && pl->next == pl->filled)
+            pthread_cond_wait(&pl->work, &pl->lock);
+        if (pl->next == pl->filled) break;
+        struct slot *s = &pl->slots[pl->next++ % pl->nslots];
+        pthread_mutex_unlock(&pl->lock);
+
+        s->out.len = 0;
+        s->count = scan_chunk(s->data, s->len, pl->mt, dfa, pl->max, NULL, 0,
+                              pl->lines ? &s->out : NULL);
+
+        pthread_mutex_lock(&pl->lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&pl->done);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    dfa_free(dfa);
+    return NULL;
+}
+
+static int grep_parallel(struct input *in, const struct matcher *mt,
+                         struct report *rp, const char *name, int jobs) {
+    struct pool pl;
+    struct buf out = {0};
+    pthread_t *tids = malloc((size_t)jobs * sizeof(*tids));
+    int started = 0, rc = 0;
+    long total = 0;
+
+    memset(&pl, 0, sizeof(pl));
+    pl.mt = mt;
+    pl.max = report_limit(rp);
+    pl.lines = rp->mode == REPORT_LINES;
+    pl.nslots = (size_t)jobs * 2;
+    pl.slots = calloc(pl.nslots, sizeof(*pl.slots));
+    if (!tids || !pl.slots) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        free(tids);
+        free(pl.slots);
         return 1;
     }
+    pthread_mutex_init(&pl.lock, NULL);
+    pthread_cond_init(&pl.work, NULL);
+    pthread_cond_init(&pl.done, NULL);
+    for (; started < jobs; started++) {
+        if (pthread_create(&tids[started], NULL, worker, &pl) != 0) break;
+    }
+    if (started == 0) {
+        free(tids);
+        free(pl.slots);
+        return grep_seq(in, mt, rp, name, 0);
+    }
+
+    size_t written = 0;
+    int eof = pl.max == 0;
+    pthread_mutex_lock(&pl.lock);
+    while (!eof || written < pl.filled) {
+        struct slot *s = &pl.slots[written % pl.nslots];
+        /* read ahead while there is room, otherwise drain in order */
+        if (!eof && pl.filled - written < pl.nslots) {
+            struct slot *t = &pl.slots[pl.filled % pl.nslots];
+            pthread_mutex_unlock(&pl.lock);
+            int r = input_next(in, INPUT_BLOCK, &t->in, &t->data, &t->len);
+            pthread_mutex_lock(&pl.lock);
+            if (r < 0) {
+                file_error(name);
+                rc = 1;
+            }
+            eof = r <= 0;
+            if (r > 0) {
+                t->state = SLOT_READY;
+                pl.filled++;
+                pthread_cond_signal(&pl.work);
+            }
+            continue;
+        }
+        while (s->state != SLOT_DONE) pthread_cond_wait(&pl.done, &pl.lock);
+        pthread_mutex_unlock(&pl.lock);
+        long k = s->count;
+        size_t n = s->out.len;
+        if (k < 0) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            rc = 1;
+            k = 0;
+        }
+        if (pl.max >= 0 && k > pl.max - total) {
+            /* cut after the last line that is still within the limit */
+            k = pl.max - total;
+            const char *p = s->out.data;
+            for (long j = 0; j < k && p; j++) {
+                p = memchr(p, '\n', n - (size_t)(p - s->out.data));
+                if (p) p++;
+            }
+            if (p) n = (size_t)(p - s->out.data);
+        }
+        total += k;
+        out_write(rp->out, s->out.data, n);
+        out_block_end(rp->out);
+        /* chunks still in flight are searched but not printed */
+        if (total == pl.max) eof = 1;
+        pthread_mutex_lock(&pl.lock);
+        s->state = SLOT_FREE;
+        written++;
+    }
+    pl.stop = 1;
+    pthread_cond_broadcast(&pl.work);
+    pthread_mutex_unlock(&pl.lock);
+
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    for (size_t i = 0; i < pl.nslots; i++) {
+        buf_free(&pl.slots[i].in);
+        buf_free(&pl.slots[i].out);
+    }
+    if (report_file(rp, name, 0, total, &out) < 0) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        rc = 1;
+    }
+    out_write(rp->out, out.data, out.len);
+    buf_free(&out);
+    free(pl.slots);
+    free(tids);
+    pthread_mutex_destroy(&pl.lock);
+    pthread_cond_destroy(&pl.work);
+    pthread_cond_destroy(&pl.done);
+    return rc;
+}
+
+
+/*
+ * Many files: every worker owns a deque of paths. It takes work from the
+ * back of its own deque and, once that runs dry, steals from the front of
+ * the others', so the entries of a directory listed by one worker spread
+ * over all of them. Directories are tasks as well, which keeps the walk
+ * itself parallel. Matches of a file are collected before they are
+ * written, so the output of different files never interleaves; a file
+ * with more than GROUP_HOLD bytes of matches takes the output lock early
+ * and writes the rest directly. Files therefore come out in the order
+ * they finish, except for -c and -l on explicit operands: their lines
+ * are kept per operand and written in command line order.
+ */
+#define GROUP_HOLD (1024 * 1024)
+
+enum { TASK_OPERAND, TASK_UNKNOWN, TASK_DIR, TASK_FILE };
+
+struct task {
+    char *path;
+    int kind;
+    int slot;               /* operand index when reported in order, or -1 */
+};
 
-    const char *pattern = argv[1];
-    FILE *f = stdin;
+struct deque {
+    pthread_mutex_t lock;
+    struct task *items;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
 
-    if (argc > 2) {
-        f = fopen(argv[2], "r");
-        if (!f) {
-            perror(argv[2]);
+struct fpool {
+    struct deque *dq;
+    int nworkers;
+    size_t pending;         /* tasks queued or running */
+    int sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    pthread_mutex_t out_lock;
+    struct buf *ordered;    /* -c/-l output by operand, under out_lock */
+    unsigned char *done;
+    int nordered;
+    int next_ordered;
+    const struct matcher *mt;
+    struct report *rp;
+    int recursive;
+    int names;
+    int failed;
+};
+
+struct fworker {
+    struct fpool *fp;
+    int id;
+    struct buf own;
+    struct buf out;
+    struct buf pre;
+    struct dfa *dfa;
+    int holding;
+};
+
+static int deque_push(struct deque *d, struct task t) {
+    int rc = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->items, d->items + d->head,
+                    (d->tail - d->head) * sizeof(*d->items));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            size_t cap = d->cap ? d->cap * 2 : 256;
+            struct task *p = realloc(d->items, cap * sizeof(*p));
+            if (p) {
+                d->items = p;
+                d->cap = cap;
+            } else {
+                rc = -1;
+            }
+        }
+    }
+    if (rc == 0) d->items[d->tail++] = t;
+    pthread_mutex_unlock(&d->lock);
+    return rc;
+}
+
+/* Own work comes from the back (depth first), stolen work from the front. */
+static int deque_take(struct deque *d, int steal, struct task *t) {
+    int got = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        *t = steal ? d->items[d->head++] : d->items[--d->tail];
+        if (d->head == d->tail) d->head = d->tail = 0;
+        got = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return got;
+}
+
+static int fpool_push(struct fpool *fp, int id, char *path, int kind,
+                      int slot) {
+    struct task t = { path, kind, slot };
+
+    __atomic_add_fetch(&fp->pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&fp->dq[id], t) < 0) {
+        __atomic_sub_fetch(&fp->pending, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    if (__atomic_load_n(&fp->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&fp->idle_lock);
+        pthread_cond_signal(&fp->idle);
+        pthread_mutex_unlock(&fp->idle_lock);
+    }
+    return 0;
+}
+
+static int fpool_take(struct fpool *fp, int id, struct task *t) {
+    if (deque_take(&fp->dq[id], 0, t)) return 1;
+    for (int k = 1; k < fp->nworkers; k++) {
+        if (deque_take(&fp->dq[(id + k) % fp->nworkers], 1, t)) return 1;
+    }
+    return 0;
+}
+
+static int fpool_queued(struct fpool *fp) {
+    for (int k = 0; k < fp->nworkers; k++) {
+        struct deque *d = &fp->dq[k];
+        pthread_mutex_lock(&d->lock);
+        int any = d->head < d->tail;
+        pthread_mutex_unlock(&d->lock);
+        if (any) return 1;
+    }
+    return 0;
+}
+
+static void fpool_fail(struct fpool *fp) {
+    __atomic_store_n(&fp->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void flush_group(struct fworker *w, int last) {
+    struct fpool *fp = w->fp;
+
+    if (!w->holding && !last && w->out.len < GROUP_HOLD) return;
+    if (!w->holding && w->out.len == 0) return;
+    if (!w->holding) {
+        pthread_mutex_lock(&fp->out_lock);
+        w->holding = 1;
+    }
+    out_write(fp->rp->out, w->out.data, w->out.len);
+    w->out.len = 0;
+    if (last) {
+        out_block_end(fp->rp->out);
+        pthread_mutex_unlock(&fp->out_lock);
+        w->holding = 0;
+    }
+}
+
+/* -c and -l output goes to `res`, matching lines to the worker's buffer. */
+static void grep_file(struct fworker *w, const char *path, struct buf *res) {
+    struct fpool *fp = w->fp;
+    struct input in;
+    int lines = fp->rp->mode == REPORT_LINES;
+    long max = report_limit(fp->rp), total = 0;
+    const char *data;
+    size_t len;
+    int r = 0;
+
+    if (input_open(&in, path) < 0) {
+        file_error(path);
+        fpool_fail(fp);
+        return;
+    }
+    w->pre.len = 0;
+    if (lines && fp->names && (buf_append(&w->pre, path, strlen(path)) < 0 ||
+                               buf_append(&w->pre, ":", 1) < 0)) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        fpool_fail(fp);
+        input_close(&in);
+        return;
+    }
+    while (total != max &&
+           (r = input_next(&in, INPUT_BLOCK, &w->own, &data, &len)) > 0) {
+        long k = scan_chunk(data, len, fp->mt, w->dfa,
+                            max < 0 ? -1 : max - total, w->pre.data,
+                            w->pre.len, lines ? &w->out : NULL);
+        if (k < 0) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            fpool_fail(fp);
+            break;
+        }
+        total += k;
+        flush_group(w, 0);
+    }
+    if (r < 0) {
+        file_error(path);
+        fpool_fail(fp);
+    }
+    if (report_file(fp->rp, path, fp->names, total, res) < 0) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        fpool_fail(fp);
+    }
+    flush_group(w, 1);
+    input_close(&in);
+}
+
+static void walk_dir(struct fworker *w, const char *path) {
+    struct fpool *fp = w->fp;
+    DIR *dir = opendir(path);
+    struct dirent *de;
+    size_t plen = strlen(path);
+    int slash = plen > 0 && path[plen - 1] == '/';
+
+    if (!dir) {
+        file_error(path);
+        fpool_fail(fp);
+        return;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        /* like grep -r, links met during the walk are not followed */
+        int kind;
+        switch (de->d_type) {
+        case DT_DIR: kind = TASK_DIR; break;
+        case DT_REG: kind = TASK_FILE; break;
+        case DT_UNKNOWN: kind = TASK_UNKNOWN; break;
+        default: continue;
+        }
+
+        size_t nlen = strlen(name);
+        char *child = malloc(plen + 1 + nlen + 1);
+        if (!child) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            fpool_fail(fp);
+            break;
+        }
+        memcpy(child, path, plen);
+        if (!slash) child[plen] = '/';
+        memcpy(child + plen + !slash, name, nlen + 1);
+        if (fpool_push(fp, w->id, child, kind, -1) < 0) {
+            free(child);
+            fprintf(stderr, "mygrep: out of memory\n");
+            fpool_fail(fp);
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static void run_task(struct fworker *w, struct task *t) {
+    struct fpool *fp = w->fp;
+    int kind = t->kind;
+
+    /* with -q one matching line anywhere settles it: drop the rest */
+    if (fp->rp->mode == REPORT_QUIET &&
+        __atomic_load_n(&fp->rp->matched, __ATOMIC_RELAXED))
+        return;
+
+    if (kind == TASK_OPERAND || kind == TASK_UNKNOWN) {
+        struct stat st;
+        int r = kind == TASK_OPERAND ? stat(t->path, &st)
+                                     : lstat(t->path, &st);
+        if (r < 0) {
+            file_error(t->path);
+            fpool_fail(fp);
+            return;
+        }
+        if (S_ISDIR(st.st_mode)) kind = TASK_DIR;
+        else if (S_ISREG(st.st_mode) || kind == TASK_OPERAND) kind = TASK_FILE;
+        else return;
+    }
+    if (kind == TASK_FILE) {
+        grep_file(w, t->path, t->slot >= 0 ? &fp->ordered[t->slot] : &w->out);
+    } else if (fp->recursive) {
+        walk_dir(w, t->path);
+    } else {
+        fprintf(stderr, "mygrep: %s: Is a directory\n", t->path);
+        fpool_fail(fp);
+    }
+}
+
+/* Marks operand `slot` finished and writes what is now due in order. */
+static void fpool_release(struct fpool *fp, int slot) {
+    pthread_mutex_lock(&fp->out_lock);
+    fp->done[slot] = 1;
+    int start = fp->next_ordered;
+    while (fp->next_ordered < fp->nordered && fp->done[fp->next_ordered]) {
+        struct buf *b = &fp->ordered[fp->next_ordered++];
+        out_write(fp->rp->out, b->data, b->len);
+        buf_free(b);
+    }
+    if (fp->next_ordered != start) out_block_end(fp->rp->out);
+    pthread_mutex_unlock(&fp->out_lock);
+}
+
+static void *file_worker(void *arg) {
+    struct fworker *w = arg;
+    struct fpool *fp = w->fp;
+    struct task t;
+
+    while (1) {
+        if (fpool_take(fp, w->id, &t)) {
+            run_task(w, &t);
+            if (t.slot >= 0) fpool_release(fp, t.slot);
+            free(t.path);
+            if (__atomic_sub_fetch(&fp->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&fp->idle_lock);
+                pthread_cond_broadcast(&fp->idle);
+                pthread_mutex_unlock(&fp->idle_lock);
+            }
+            continue;
+        }
+        /*
+         * A pusher checks `sleepers` after queueing, an idle worker checks
+         * the deques after announcing itself: one of them sees the other.
+         */
+        pthread_mutex_lock(&fp->idle_lock);
+        __atomic_add_fetch(&fp->sleepers, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&fp->pending, __ATOMIC_SEQ_CST) == 0;
+        if (!done && !fpool_queued(fp))
+            pthread_cond_wait(&fp->idle, &fp->idle_lock);
+        __atomic_sub_fetch(&fp->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&fp->idle_lock);
+        if (done) break;
+    }
+    return NULL;
+}
+
+static int grep_files(char **paths, int npaths, const struct matcher *mt,
+                      struct report *rp, int jobs, int recursive) {
+    struct fpool fp;
+    struct fworker *ws = calloc((size_t)jobs, sizeof(*ws));
+    pthread_t *tids = malloc((size_t)jobs * sizeof(*tids));
+    int started = 1;
+
+    memset(&fp, 0, sizeof(fp));
+    fp.dq = calloc((size_t)jobs, sizeof(*fp.dq));
+    if (!ws || !tids || !fp.dq) {
+        fprintf(stderr, "mygrep: out of memory\n");
+        free(ws);
+        free(tids);
+        free(fp.dq);
+        return 1;
+    }
+    fp.nworkers = jobs;
+    fp.mt = mt;
+    fp.rp = rp;
+    fp.recursive = recursive;
+    fp.names = recursive || npaths > 1;
+    if (!recursive && (rp->mode == REPORT_COUNT || rp->mode == REPORT_FILES)) {
+        fp.ordered = calloc((size_t)npaths + 1, sizeof(*fp.ordered));
+        fp.done = calloc((size_t)npaths + 1, 1);
+        if (!fp.ordered || !fp.done) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            free(fp.ordered);
+            free(fp.done);
+            free(ws);
+            free(tids);
+            free(fp.dq);
             return 1;
         }
+        fp.nordered = npaths;
+    }
+    pthread_mutex_init(&fp.idle_lock, NULL);
+    pthread_cond_init(&fp.idle, NULL);
+    pthread_mutex_init(&fp.out_lock, NULL);
+    for (int k = 0; k < jobs; k++) {
+        pthread_mutex_init(&fp.dq[k].lock, NULL);
+        ws[k].fp = &fp;
+        ws[k].id = k;
+        ws[k].dfa = mt->re ? dfa_new(mt->re) : NULL;
+    }
+
+    /*
+     * Operands are dealt out round robin, last first so that a worker
+     * popping its own deque meets them in command line order.
+     */
+    static char dot[] = ".";
+    char *none[] = { dot };
+    if (npaths == 0) {
+        paths = none;
+        npaths = 1;
+    }
+    for (int k = npaths - 1; k >= 0; k--) {
+        char *p = strdup(paths[k]);
+        if (!p || fpool_push(&fp, k % jobs, p, TASK_OPERAND,
+                             fp.ordered ? k : -1) < 0) {
+            free(p);
+            fprintf(stderr, "mygrep: out of memory\n");
+            fp.failed = 1;
+            break;
+        }
+    }
+
+    /* the calling thread is worker 0 */
+    for (; started < jobs; started++) {
+        if (pthread_create(&tids[started], NULL, file_worker,
+                           &ws[started]) != 0)
+            break;
+    }
+    /* deques of workers that failed to start are stolen from */
+    file_worker(&ws[0]);
+    for (int k = 1; k < started; k++) pthread_join(tids[k], NULL);
+
+    for (int k = 0; k < jobs; k++) {
+        free(fp.dq[k].items);
+        pthread_mutex_destroy(&fp.dq[k].lock);
+        buf_free(&ws[k].own);
+        buf_free(&ws[k].out);
+        buf_free(&ws[k].pre);
+        dfa_free(ws[k].dfa);
     }
+    pthread_mutex_destroy(&fp.idle_lock);
+    pthread_cond_destroy(&fp.idle);
+    pthread_mutex_destroy(&fp.out_lock);
+    for (int k = fp.next_ordered; k < fp.nordered; k++) buf_free(&fp.ordered[k]);
+    free(fp.ordered);
+    free(fp.done);
+    free(fp.dq);
+    free(ws);
+    free(tids);
+    return fp.failed;
+}
+
+#else
 
-    char line[4096];
-    while (fgets(line, sizeof(line), f)) {
-        if (strstr(line, pattern)) {
-            fputs(line, stdout);
+/* Without threads files are searched one after the other, and not walked. */
+static int grep_files(char **paths, int npaths, const struct matcher *mt,
+                      struct report *rp, int jobs, int recursive) {
+    int rc = 0;
+
+    (void)jobs;
+    if (recursive) {
+        fprintf(stderr, "mygrep: -r is not supported on this platform\n");
+        return 1;
+    }
+    for (int k = 0; k < npaths; k++) {
+        struct input in;
+        if (rp->mode == REPORT_QUIET && rp->matched) break;
+        if (input_open(&in, paths[k]) < 0) {
+            file_error(paths[k]);
+            rc = 1;
+            continue;
         }
+        rc |= grep_seq(&in, mt, rp, paths[k], npaths > 1);
+        input_close(&in);
     }
+    return rc;
+}
+
+#endif
 
-    if (f != stdin) fclose(f);
+/* Appends `text` to the pattern list, one pattern per line. */
+static int add_patterns(struct buf *pats, const char *text, size_t len) {
+    if (buf_append(pats, text, len) < 0) return -1;
+    if (len == 0 || text[len - 1] != '\n') return buf_append(pats, "\n", 1);
     return 0;
 }
+
+/* Adds the lines of `path` ("-" for standard input) as patterns. */
+static int read_patterns(struct buf *pats, const char *path) {
+    struct buf own = {0};
+    struct input in;
+    const char *data;
+    size_t len;
+    int r;
+
+    if (input_open(&in, strcmp(path, "-") == 0 ? NULL : path) < 0) {
+        file_error(path);
+        return -1;
+    }
+    while ((r = input_next(&in, INPUT_BLOCK, &own, &data, &len)) > 0) {
+        if (add_patterns(pats, data, len) < 0) break;
+    }
+    if (r != 0) file_error(path);
+    input_close(&in);
+    buf_free(&own);
+    return r == 0 ? 0 : -1;
+}
+
+static const char *opt_value(int argc, char *argv[], int *i) {
+    const char *a = argv[*i];
+    if (a[2]) return a + 2;
+    return *i + 1 < argc ? argv[++*i] : NULL;
+}
+
+int mygrep_run(int argc, char *argv[]) {
+    struct buf pats = {0};
+    struct matcher mt;
+    struct report rp = { REPORT_LINES, -1, 0, NULL };
+    struct output out;
+    const char *err;
+    int have_pats = 0;
+    int extended = 0;
+    int jobs = 1;
+    int recursive = 0;
+    int i = 1;
+    int rc = 1;
+
+    for (; i < argc; ++i) {
+        const char *a = argv[i];
+        if (a[0] != '-' || a[1] == '\0') break;
+        if (strcmp(a, "--") == 0) {
+            i++;
+            break;
+        }
+        if (a[1] == 'j') {
+            const char *v = opt_value(argc, argv, &i);
+            char *end;
+            long n = v ? strtol(v, &end, 10) : -1;
+            if (!v || *end || n < 0 || n > 1024) {
+                fprintf(stderr, "mygrep: invalid number of jobs\n");
+                goto out;
+            }
+            jobs = (int)n;
+        } else if (a[1] == 'm') {
+            const char *v = opt_value(argc, argv, &i);
+            char *end;
+            long n = v ? strtol(v, &end, 10) : -1;
+            if (!v || *end || n < 0) {
+                fprintf(stderr, "mygrep: invalid max count\n");
+                goto out;
+            }
+            rp.max = n;
+        } else if (a[1] == 'e' || a[1] == 'f') {
+            const char *v = opt_value(argc, argv, &i);
+            if (!v) {
+                fprintf(stderr, "mygrep: option '-%c' needs an argument\n",
+                        a[1]);
+                usage();
+                goto out;
+            }
+            if (a[1] == 'f') {
+                if (read_patterns(&pats, v) < 0) goto out;
+            } else if (add_patterns(&pats, v, strlen(v)) < 0) {
+                fprintf(stderr, "mygrep: out of memory\n");
+                goto out;
+            }
+            have_pats = 1;
+        } else if (strcmp(a, "-r") == 0) {
+            recursive = 1;
+        } else if (strcmp(a, "-E") == 0) {
+            extended = 1;
+        } else if (strcmp(a, "-c") == 0 || strcmp(a, "-l") == 0 ||
+                   strcmp(a, "-q") == 0) {
+            /* -q beats -l beats -c, whatever the order */
+            int mode = a[1] == 'c' ? REPORT_COUNT :
+                       a[1] == 'l' ? REPORT_FILES : REPORT_QUIET;
+            if (mode > rp.mode) rp.mode = mode;
+        } else {
+            fprintf(stderr, "mygrep: unknown option '%s'\n", a);
+            usage();
+            goto out;
+        }
+    }
+    if (!have_pats) {
+        if (i >= argc) {
+            usage();
+            goto out;
+        }
+        if (add_patterns(&pats, argv[i], strlen(argv[i])) < 0) {
+            fprintf(stderr, "mygrep: out of memory\n");
+            goto out;
+        }
+        i++;
+    }
+    if (matcher_init(&mt, pats.data, pats.len, extended, &err) < 0) {
+        fprintf(stderr, "mygrep: %s\n", err);
+        goto out;
+    }
+
+    int nfiles = argc - i;
+
+    out_init(&out, 1);
+    rp.out = &out;
+    search_init();
+#ifdef HAVE_THREADS
+    /* -j 0 means one worker per online CPU */
+    if (jobs == 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+#endif
+    if (recursive || nfiles > 1) {
+        rc = grep_files(argv + i, nfiles, &mt, &rp, jobs, recursive);
+    } else {
+        const char *path = nfiles ? argv[i] : NULL;
+        const char *name = path ? path : "(standard input)";
+        struct input in;
+
+        if (input_open(&in, path) < 0) {
+            file_error(name);
+        } else {
+#ifdef HAVE_THREADS
+            if (jobs > 1) rc = grep_parallel(&in, &mt, &rp, name, jobs);
+            else rc = grep_seq(&in, &mt, &rp, name, 0);
+#else
+            rc = grep_seq(&in, &mt, &rp, name, 0);
+#endif
+            input_close(&in);
+        }
+    }
+    if (out_flush(&out) < 0) {
+        perror("mygrep: write error");
+        rc = 1;
+    }
+    out_close(&out);
+    /* -q answers whether anything matched */
+    if (rp.mode == REPORT_QUIET) rc = !rp.matched;
+    ac_free(mt.ac);
+    regex_free(mt.re);
+out:
+    buf_free(&pats);
+    return rc;
+}
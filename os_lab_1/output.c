@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include "output.h"
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#define HAVE_WRITEV 1
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#define HAVE_SPLICE 1
+#define COPY_CHUNK (1 << 30)
+#endif
+
+void out_init(struct output *o, int fd) {
+    memset(o, 0, sizeof(*o));
+    o->fd = fd;
+#ifdef HAVE_WRITEV
+    o->tty = isatty(fd);
+#endif
+    /* without a buffer every piece is written as it comes */
+    o->buf = malloc(OUTPUT_BUF);
+    if (o->buf) o->cap = OUTPUT_BUF;
+}
+
+/* Writes a then b, as one writev() where possible. */
+static int write_two(struct output *o, const char *a, size_t na,
+                     const char *b, size_t nb) {
+#ifdef HAVE_WRITEV
+    struct iovec iov[2] = {
+        { (void *)a, na },
+        { (void *)b, nb },
+    };
+    int k = na ? 0 : 1;
+    while (k < 2) {
+        ssize_t w = writev(o->fd, iov + k, 2 - k);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        /* skip what went out, the rest is retried */
+        size_t done = (size_t)w;
+        while (k < 2 && done >= iov[k].iov_len) done -= iov[k++].iov_len;
+        if (k < 2) {
+            iov[k].iov_base = (char *)iov[k].iov_base + done;
+            iov[k].iov_len -= done;
+        }
+    }
+    return 0;
+#else
+    FILE *f = o->fd == 2 ? stderr : stdout;
+    if ((na && fwrite(a, 1, na, f) != na) ||
+        (nb && fwrite(b, 1, nb, f) != nb) || fflush(f) != 0)
+        return -1;
+    return 0;
+#endif
+}
+
+int out_flush(struct output *o) {
+    if (!o->err && o->len && write_two(o, o->buf, o->len, NULL, 0) < 0)
+        o->err = 1;
+    o->len = 0;
+    return o->err ? -1 : 0;
+}
+
+int out_write_slow(struct output *o, const char *p, size_t n) {
+    if (o->err) return -1;
+    /* big pieces are not copied: they leave together with the buffer */
+    if (n >= o->cap / 2) {
+        if (write_two(o, o->buf, o->len, p, n) < 0) o->err = 1;
+        o->len = 0;
+        return o->err ? -1 : 0;
+    }
+    if (out_flush(o) < 0) return -1;
+    memcpy(o->buf, p, n);
+    o->len = n;
+    return 0;
+}
+
+void out_block_end(struct output *o) {
+    if (o->tty) out_flush(o);
+}
+
+#ifdef HAVE_SPLICE
+
+enum { COPY_RANGE, COPY_SEND, COPY_SPLICE };
+
+/* Errors that mean the call cannot be used here, not that the copy failed. */
+static int unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+int out_copy(struct output *o, FILE *f) {
+    int fd = fileno(f);
+    struct stat st;
+    int how;
+    size_t moved = 0;
+
+    if (o->err || fstat(fd, &st) < 0) return 0;
+    /*
+     * Files that claim to be empty are read normally: /proc and /sys
+     * files have a size of 0 and copy_file_range would copy nothing.
+     */
+    if (S_ISREG(st.st_mode) && st.st_size > 0) how = COPY_RANGE;
+    else if (S_ISFIFO(st.st_mode)) how = COPY_SPLICE;
+    else return 0;
+    if (out_flush(o) < 0) return -1;
+
+    while (1) {
+        ssize_t r;
+        if (how == COPY_RANGE)
+            r = copy_file_range(fd, NULL, o->fd, NULL, COPY_CHUNK, 0);
+        else if (how == COPY_SEND)
+            r = sendfile(o->fd, fd, NULL, COPY_CHUNK);
+        else
+            r = splice(fd, NULL, o->fd, NULL, COPY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (r > 0) {
+            moved += (size_t)r;
+            continue;
+        }
+        if (r == 0) return 1;
+        if (errno == EINTR) continue;
+        /* copy_file_range only writes to files; sendfile takes any fd */
+        if (moved == 0 && unsupported(errno)) {
+            if (how != COPY_RANGE) return 0;
+            how = COPY_SEND;
+            continue;
+        }
+        return -1;
+    }
+}
+
+#else
+
+int out_copy(struct output *o, FILE *f) {
+    (void)o;
+    (void)f;
+    return 0;
+}
+
+#endif
+
+int out_num(struct output *o, uint64_t v, int width) {
+    char tmp[32];
+    int i = (int)sizeof(tmp);
+
+    do {
+        tmp[--i] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (i > (int)sizeof(tmp) - width && i > 0) tmp[--i] = ' ';
+    return out_write(o, tmp + i, sizeof(tmp) - (size_t)i);
+}
+
+void out_close(struct output *o) {
+    free(o->buf);
+    o->buf = NULL;
+    o->len = o->cap = 0;
+}
@@ -0,0 +1,60 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OUTPUT_BUF (1024 * 1024)
+
+/*
+ * Buffered writer on a file descriptor. Output is collected in one large
+ * buffer and leaves with write(), or writev() when a big piece of data
+ * can go out together with what is buffered, so there is no per-call
+ * formatting or locking as with stdio. After a failed write everything
+ * else is dropped and out_flush() reports the error.
+ */
+struct output {
+    int fd;
+    int tty;
+    int err;
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+void out_init(struct output *o, int fd);
+int out_flush(struct output *o);
+void out_close(struct output *o);
+
+/* Called at the end of an input block: pushes the output to a terminal. */
+void out_block_end(struct output *o);
+
+int out_write_slow(struct output *o, const char *p, size_t n);
+
+static inline int out_write(struct output *o, const char *p, size_t n) {
+    if (n > o->cap - o->len) return out_write_slow(o, p, n);
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+    return 0;
+}
+
+static inline int out_byte(struct output *o, char c) {
+    if (o->len == o->cap) return out_write_slow(o, &c, 1);
+    o->buf[o->len++] = c;
+    return 0;
+}
+
+/*
+ * Copies the rest of `f` to the output inside the kernel, without passing
+ * it through user space, where the system can do that for the kind of
+ * file it is. Returns 1 when all of it was copied, 0 when nothing was and
+ * the caller has to read it, -1 on errors.
+ */
+int out_copy(struct output *o, FILE *f);
+
+/* Writes v in decimal, padded with spaces on the left to `width`. */
+int out_num(struct output *o, uint64_t v, int width);
+
+#endif
@@ -0,0 +1,1097 @@
+#include "regex.h"
+#include "ac.h"
+#include "search.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The patterns are parsed into a syntax tree, the tree is compiled into a
+ * Thompson NFA, and the NFA is turned into a DFA lazily: a DFA state (a
+ * set of NFA states) and its transitions are only built when the search
+ * first needs them, and then cached. When the cache is full it is thrown
+ * away and rebuilt, so memory stays bounded even for expressions whose
+ * full DFA would be huge.
+ *
+ * Before the DFA runs at all, literals that every match has to contain
+ * are looked for with the substring kernel (or Aho-Corasick when there
+ * are several alternatives); only lines holding one are run through the
+ * DFA.
+ *
+ * Concatenations and alternations are chains leaning left, which every
+ * pass over the tree walks in a loop; only groups and repetitions are
+ * recursed into, and patterns nesting those more than MAX_DEPTH deep
+ * are rejected, so that no pattern can exhaust the stack.
+ */
+
+#define MAX_REPEAT 1000
+#define MAX_DEPTH 1000
+#define MAX_NFA (1 << 20)
+#define MAX_LITS 64
+#define DFA_STATES 4096
+
+struct cset {
+    uint64_t w[4];
+};
+
+static void cset_add(struct cset *s, unsigned b) {
+    s->w[b >> 6] |= (uint64_t)1 << (b & 63);
+}
+
+static int cset_has(const struct cset *s, unsigned b) {
+    return (int)((s->w[b >> 6] >> (b & 63)) & 1);
+}
+
+/* ---- syntax tree ---- */
+
+enum { N_EMPTY, N_SET, N_CAT, N_ALT, N_REP, N_BOL, N_EOL };
+
+struct node {
+    int type;
+    int a, b;           /* children */
+    int min, max;       /* N_REP; max < 0 means no bound */
+    int set;            /* N_SET */
+    int ch;             /* N_SET of a single byte, else -1 */
+    int depth;          /* recursion the passes over the tree need here */
+};
+
+/* ---- NFA ---- */
+
+enum { S_CHAR, S_SPLIT, S_EPS, S_BOL, S_EOL, S_MATCH };
+
+struct nstate {
+    int type;
+    int out, out1;
+    int set;
+};
+
+struct regex {
+    struct node *nodes;
+    size_t nnodes, nodes_cap;
+    struct cset *sets;
+    size_t nsets, sets_cap;
+    struct nstate *nfa;
+    size_t nnfa, nfa_cap;
+    int start;
+
+    uint16_t cls[256];
+    size_t ncls;
+    unsigned char rep[256];     /* a byte of every class */
+
+    /* closures of the start state at and after the beginning of a line */
+    int *bol_set;
+    size_t bol_len;
+    int *mid_set;
+    size_t mid_len;
+    unsigned char first[256];   /* bytes a match can start with, and '\n' */
+
+    /* required literals: one searched directly, or several with ac */
+    char *lit;
+    size_t lit_len;
+    struct ac *lits;
+    int exact;                  /* finding a literal is finding a match */
+};
+
+static int new_node(struct regex *re, int type) {
+    if (re->nnodes == re->nodes_cap) {
+        size_t cap = re->nodes_cap ? re->nodes_cap * 2 : 64;
+        struct node *p = realloc(re->nodes, cap * sizeof(*p));
+        if (!p) return -1;
+        re->nodes = p;
+        re->nodes_cap = cap;
+    }
+    struct node *n = &re->nodes[re->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->ch = -1;
+    n->depth = 1;
+    return (int)re->nnodes++;
+}
+
+static int new_set(struct regex *re) {
+    if (re->nsets == re->sets_cap) {
+        size_t cap = re->sets_cap ? re->sets_cap * 2 : 64;
+        struct cset *p = realloc(re->sets, cap * sizeof(*p));
+        if (!p) return -1;
+        re->sets = p;
+        re->sets_cap = cap;
+    }
+    memset(&re->sets[re->nsets], 0, sizeof(*re->sets));
+    return (int)re->nsets++;
+}
+
+/* ---- parser ---- */
+
+struct parser {
+    struct regex *re;
+    const unsigned char *p, *end;
+    const char *err;
+};
+
+static int oom(struct parser *ps) {
+    ps->err = "out of memory";
+    return -1;
+}
+
+static int too_complex(struct parser *ps) {
+    ps->err = "pattern too complex";
+    return -1;
+}
+
+/* A chain link: its left child is walked in a loop, its right recursed into. */
+static int binary(struct parser *ps, int type, int a, int b) {
+    struct node *nodes = ps->re->nodes;
+    int depth = nodes[b].depth + 1;
+    if (depth < nodes[a].depth) depth = nodes[a].depth;
+    if (depth > MAX_DEPTH) return too_complex(ps);
+    int n = new_node(ps->re, type);
+    if (n < 0) return oom(ps);
+    nodes = ps->re->nodes;
+    nodes[n].a = a;
+    nodes[n].b = b;
+    nodes[n].depth = depth;
+    return n;
+}
+
+static int byte_node(struct parser *ps, unsigned b) {
+    int s = new_set(ps->re), n = new_node(ps->re, N_SET);
+    if (s < 0 || n < 0) return oom(ps);
+    cset_add(&ps->re->sets[s], b);
+    ps->re->nodes[n].set = s;
+    ps->re->nodes[n].ch = (int)b;
+    return n;
+}
+
+static int set_node(struct parser *ps, struct cset *cs, int negate) {
+    int s = new_set(ps->re), n = new_node(ps->re, N_SET);
+    if (s < 0 || n < 0) return oom(ps);
+    for (int k = 0; k < 4; k++)
+        ps->re->sets[s].w[k] = negate ? ~cs->w[k] : cs->w[k];
+    /* lines are matched one at a time, nothing matches their end */
+    ps->re->sets[s].w['\n' >> 6] &= ~((uint64_t)1 << ('\n' & 63));
+    ps->re->nodes[n].set = s;
+    return n;
+}
+
+static void add_range(struct cset *cs, unsigned lo, unsigned hi) {
+    for (unsigned b = lo; b <= hi; b++) cset_add(cs, b);
+}
+
+static int in_class(const char *name, unsigned b) {
+    static const char *const names[] = {
+        "alpha", "digit", "alnum", "upper", "lower", "space",
+        "punct", "xdigit", "blank", "cntrl", "print", "graph",
+    };
+    int k = 0;
+    while (k < 12 && strcmp(name, names[k]) != 0) k++;
+    switch (k) {
+    case 0: return (b | 32) >= 'a' && (b | 32) <= 'z';
+    case 1: return b >= '0' && b <= '9';
+    case 2: return in_class("alpha", b) || in_class("digit", b);
+    case 3: return b >= 'A' && b <= 'Z';
+    case 4: return b >= 'a' && b <= 'z';
+    case 5: return b == ' ' || (b >= '\t' && b <= '\r');
+    case 6: return b > ' ' && b < 127 && !in_class("alnum", b);
+    case 7:
+        return in_class("digit", b) || ((b | 32) >= 'a' && (b | 32) <= 'f');
+    case 8: return b == ' ' || b == '\t';
+    case 9: return b < ' ' || b == 127;
+    case 10: return b >= ' ' && b < 127;
+    case 11: return b > ' ' && b < 127;
+    default: return -1;
+    }
+}
+
+/* Parses a bracket expression; ps->p is just past the '['. */
+static int parse_bracket(struct parser *ps) {
+    struct cset cs;
+    int negate = 0, first = 1;
+
+    memset(&cs, 0, sizeof(cs));
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    while (1) {
+        if (ps->p >= ps->end) {
+            ps->err = "unmatched [";
+            return -1;
+        }
+        unsigned c = *ps->p++;
+        if (c == ']' && !first) break;
+        first = 0;
+        if (c == '[' && ps->p < ps->end && *ps->p == ':') {
+            const unsigned char *q = ps->p + 1;
+            while (q + 1 < ps->end && !(q[0] == ':' && q[1] == ']')) q++;
+            char name[16];
+            size_t len = (size_t)(q - ps->p - 1);
+            if (q + 1 >= ps->end || len >= sizeof(name)) {
+                ps->err = "bad character class";
+                return -1;
+            }
+            memcpy(name, ps->p + 1, len);
+            name[len] = '\0';
+            if (in_class(name, 'a') < 0) {
+                ps->err = "bad character class";
+                return -1;
+            }
+            for (unsigned b = 0; b < 256; b++)
+                if (in_class(name, b)) cset_add(&cs, b);
+            ps->p = q + 2;
+            continue;
+        }
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            unsigned hi = ps->p[1];
+            if (hi < c) {
+                ps->err = "bad range in [ ]";
+                return -1;
+            }
+            add_range(&cs, c, hi);
+            ps->p += 2;
+            continue;
+        }
+        cset_add(&cs, c);
+    }
+    return set_node(ps, &cs, negate);
+}
+
+static int parse_escape(struct parser *ps) {
+    if (ps->p >= ps->end) {
+        ps->err = "trailing backslash";
+        return -1;
+    }
+    unsigned c = *ps->p++;
+    struct cset cs;
+    memset(&cs, 0, sizeof(cs));
+    switch (c) {
+    case 'd': case 'D':
+        add_range(&cs, '0', '9');
+        return set_node(ps, &cs, c == 'D');
+    case 'w': case 'W':
+        add_range(&cs, '0', '9');
+        add_range(&cs, 'A', 'Z');
+        add_range(&cs, 'a', 'z');
+        cset_add(&cs, '_');
+        return set_node(ps, &cs, c == 'W');
+    case 's': case 'S':
+        add_range(&cs, '\t', '\r');
+        cset_add(&cs, ' ');
+        return set_node(ps, &cs, c == 'S');
+    case 'b': case 'B': case '<': case '>': case '`': case '\'':
+        ps->err = "word and buffer anchors are not supported";
+        return -1;
+    default:
+        if (c >= '1' && c <= '9') {
+            ps->err = "back-references are not supported";
+            return -1;
+        }
+        return byte_node(ps, c);
+    }
+}
+
+static int parse_alt(struct parser *ps, int depth);
+
+static int parse_atom(struct parser *ps, int depth) {
+    unsigned c = *ps->p++;
+    switch (c) {
+    case '(': {
+        if (depth >= MAX_DEPTH) return too_complex(ps);
+        int n = parse_alt(ps, depth + 1);
+        if (n < 0) return -1;
+        if (ps->p >= ps->end || *ps->p != ')') {
+            ps->err = "unmatched (";
+            return -1;
+        }
+        ps->p++;
+        return n;
+    }
+    case '.': {
+        struct cset cs;
+        memset(&cs, 0, sizeof(cs));
+        return set_node(ps, &cs, 1);
+    }
+    case '[':
+        return parse_bracket(ps);
+    case '\\':
+        return parse_escape(ps);
+    case '^':
+    case '$': {
+        int n = new_node(ps->re, c == '^' ? N_BOL : N_EOL);
+        return n < 0 ? oom(ps) : n;
+    }
+    default:
+        /* a repetition with nothing to repeat is an ordinary character */
+        return byte_node(ps, c);
+    }
+}
+
+static int parse_number(struct parser *ps, int *v) {
+    const unsigned char *start = ps->p;
+    long n = 0;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        if (n <= MAX_REPEAT) n = n * 10 + (*ps->p - '0');
+        ps->p++;
+    }
+    *v = (int)(n > MAX_REPEAT ? MAX_REPEAT + 1 : n);
+    return ps->p > start;
+}
+
+/* Parses {m}, {m,} or {m,n}; anything else leaves '{' an ordinary byte. */
+static int parse_bound(struct parser *ps, int *min, int *max) {
+    const unsigned char *save = ps->p;
+    ps->p++;
+    if (!parse_number(ps, min)) goto literal;
+    *max = *min;
+    if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        if (!parse_number(ps, max)) *max = -1;
+    }
+    if (ps->p >= ps->end || *ps->p != '}') goto literal;
+    ps->p++;
+    if (*min > MAX_REPEAT || *max > MAX_REPEAT) {
+        ps->err = "repetition count too large";
+        return -1;
+    }
+    if (*max >= 0 && *max < *min) {
+        ps->err = "invalid repetition count";
+        return -1;
+    }
+    return 1;
+literal:
+    ps->p = save;
+    return 0;
+}
+
+static int parse_repeat(struct parser *ps, int depth) {
+    int n = parse_atom(ps, depth);
+    while (n >= 0 && ps->p < ps->end) {
+        int min, max;
+        unsigned c = *ps->p;
+        if (c == '{') {
+            int r = parse_bound(ps, &min, &max);
+            if (r < 0) return -1;
+            if (r == 0) break;
+        } else if (c == '*' || c == '+' || c == '?') {
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+            ps->p++;
+        } else {
+            break;
+        }
+        if (ps->re->nodes[n].depth >= MAX_DEPTH) return too_complex(ps);
+        int r = new_node(ps->re, N_REP);
+        if (r < 0) return oom(ps);
+        ps->re->nodes[r].a = n;
+        ps->re->nodes[r].min = min;
+        ps->re->nodes[r].max = max;
+        ps->re->nodes[r].depth = ps->re->nodes[n].depth + 1;
+        n = r;
+    }
+    return n;
+}
+
+static int parse_cat(struct parser *ps, int depth) {
+    int n = -1;
+    while (ps->p < ps->end && *ps->p != '|' &&
+           !(*ps->p == ')' && depth > 0)) {
+        int m = parse_repeat(ps, depth);
+        if (m < 0) return -1;
+        n = n < 0 ? m : binary(ps, N_CAT, n, m);
+        if (n < 0) return -1;
+    }
+    if (n < 0) {
+        n = new_node(ps->re, N_EMPTY);
+        if (n < 0) return oom(ps);
+    }
+    return n;
+}
+
+static int parse_alt(struct parser *ps, int depth) {
+    int n = parse_cat(ps, depth);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int m = parse_cat(ps, depth);
+        if (m < 0) return -1;
+        n = binary(ps, N_ALT, n, m);
+    }
+    return n;
+}
+
+/* ---- required literals ---- */
+
+struct lits {
+    size_t n;
+    char *s[MAX_LITS];
+    size_t len[MAX_LITS];
+};
+
+static void lits_clear(struct lits *l) {
+    for (size_t k = 0; k < l->n; k++) free(l->s[k]);
+    l->n = 0;
+}
+
+/* Worst case length of a set; a literal set is as good as its shortest. */
+static size_t lits_score(const struct lits *l) {
+    size_t best = (size_t)-1;
+    if (l->n == 0) return 0;
+    for (size_t k = 0; k < l->n; k++)
+        if (l->len[k] < best) best = l->len[k];
+    return best;
+}
+
+static void lits_keep_better(struct lits *best, struct lits *cand) {
+    size_t a = lits_score(best), b = lits_score(cand);
+    if (b > a || (b == a && b > 0 && cand->n < best->n)) {
+        lits_clear(best);
+        *best = *cand;
+        cand->n = 0;
+    } else {
+        lits_clear(cand);
+    }
+}
+
+static void required(const struct regex *re, int id, struct lits *out);
+
+static void flush_run(const char *run, size_t len, struct lits *best) {
+    struct lits cand;
+    cand.n = 0;
+    if (len == 0) return;
+    cand.s[0] = malloc(len);
+    if (!cand.s[0]) return;
+    memcpy(cand.s[0], run, len);
+    cand.len[0] = len;
+    cand.n = 1;
+    lits_keep_better(best, &cand);
+}
+
+static void required_cat(const struct regex *re, int id, struct lits *best,
+                         char *run, size_t *run_len);
+
+/* Adds one element of a concatenation to the run, or ends the run. */
+static void required_elem(const struct regex *re, int id, struct lits *best,
+                          char *run, size_t *run_len) {
+    const struct node *n = &re->nodes[id];
+    if (n->type == N_CAT) {
+        required_cat(re, id, best, run, run_len);
+        return;
+    }
+    if (n->type == N_SET && n->ch >= 0) {
+        if (*run_len == 255) {
+            flush_run(run, *run_len, best);
+            *run_len = 0;
+        }
+        run[(*run_len)++] = (char)n->ch;
+        return;
+    }
+    flush_run(run, *run_len, best);
+    *run_len = 0;
+    if (n->type == N_REP || n->type == N_ALT) {
+        struct lits cand;
+        required(re, id, &cand);
+        lits_keep_better(best, &cand);
+    }
+}
+
+/*
+ * Walks a concatenation left to right, joining adjacent bytes into runs.
+ * The chain leans left, so its elements are listed from the right first.
+ */
+static void required_cat(const struct regex *re, int id, struct lits *best,
+                         char *run, size_t *run_len) {
+    size_t n = 1;
+    for (int k = id; re->nodes[k].type == N_CAT; k = re->nodes[k].a) n++;
+    int *elems = malloc(n * sizeof(*elems));
+    if (!elems) {
+        /* no literal is always a correct answer */
+        *run_len = 0;
+        lits_clear(best);
+        return;
+    }
+    for (size_t k = n; k-- > 1; id = re->nodes[id].a) elems[k] = re->nodes[id].b;
+    elems[0] = id;
+    for (size_t k = 0; k < n; k++)
+        required_elem(re, elems[k], best, run, run_len);
+    free(elems);
+}
+
+/* A set of literals one of which every match of node `id` contains. */
+static void required(const struct regex *re, int id, struct lits *out) {
+    const struct node *n = &re->nodes[id];
+    out->n = 0;
+    switch (n->type) {
+    case N_SET:
+        if (n->ch < 0) break;
+        /* fall through */
+    case N_CAT: {
+        char run[256];
+        size_t run_len = 0;
+        required_cat(re, id, out, run, &run_len);
+        flush_run(run, run_len, out);
+        break;
+    }
+    case N_REP:
+        if (n->min > 0) required(re, n->a, out);
+        break;
+    case N_ALT: {
+        /* one literal set per alternative, right to left down the chain */
+        struct lits b;
+        for (;; id = re->nodes[id].a) {
+            int alt = re->nodes[id].type == N_ALT;
+            required(re, alt ? re->nodes[id].b : id, &b);
+            if (b.n == 0 || out->n + b.n > MAX_LITS) {
+                lits_clear(out);
+                lits_clear(&b);
+                break;
+            }
+            for (size_t k = 0; k < b.n; k++) {
+                out->s[out->n] = b.s[k];
+                out->len[out->n++] = b.len[k];
+            }
+            if (!alt) break;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Length of a run of bytes, or -1 if node `id` is anything else. */
+static int run_len(const struct regex *re, int id) {
+    int len = 0;
+    for (; re->nodes[id].type == N_CAT; id = re->nodes[id].a) {
+        int b = run_len(re, re->nodes[id].b);
+        if (b < 0) return -1;
+        len += b;
+    }
+    const struct node *n = &re->nodes[id];
+    return n->type == N_SET && n->ch >= 0 ? len + 1 : -1;
+}
+
+/*
+ * An alternation of byte runs is its own required literal set, so finding
+ * one of the literals already is a match. Returns the longest run, or -1.
+ */
+static int exact_len(const struct regex *re, int id) {
+    int best = -1;
+    for (; re->nodes[id].type == N_ALT; id = re->nodes[id].a) {
+        int b = exact_len(re, re->nodes[id].b);
+        if (b < 0) return -1;
+        if (b > best) best = b;
+    }
+    int a = run_len(re, id);
+    return a < 0 ? -1 : (a > best ? a : best);
+}
+
+/* ---- NFA construction ---- */
+
+static int emit(struct regex *re, int type, int out, int out1, int set) {
+    if (re->nnfa == re->nfa_cap) {
+        if (re->nfa_cap >= MAX_NFA) return -1;
+        size_t cap = re->nfa_cap ? re->nfa_cap * 2 : 256;
+        struct nstate *p = realloc(re->nfa, cap * sizeof(*p));
+        if (!p) return -1;
+        re->nfa = p;
+        re->nfa_cap = cap;
+    }
+    struct nstate *s = &re->nfa[re->nnfa];
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    s->set = set;
+    return (int)re->nnfa++;
+}
+
+/* Returns the entry of node `id`'s states, which continue to `next`. */
+static int compile(struct regex *re, int id, int next) {
+    const struct node n = re->nodes[id];
+    int a, b;
+
+    if (next < 0) return -1;
+    switch (n.type) {
+    case N_EMPTY:
+        return next;
+    case N_SET:
+        return emit(re, S_CHAR, next, -1, n.set);
+    case N_BOL:
+        return emit(re, S_BOL, next, -1, -1);
+    case N_EOL:
+        return emit(re, S_EOL, next, -1, -1);
+    case N_CAT:
+        /* right to left, each element continuing to the one after it */
+        for (; re->nodes[id].type == N_CAT && next >= 0; id = re->nodes[id].a)
+            next = compile(re, re->nodes[id].b, next);
+        return compile(re, id, next);
+    case N_ALT: {
+        /* a split per alternative; each one's `out` leads to the next split */
+        int entry = -1, prev = -1;
+        for (; re->nodes[id].type == N_ALT; id = re->nodes[id].a) {
+            b = compile(re, re->nodes[id].b, next);
+            int s = b < 0 ? -1 : emit(re, S_SPLIT, -1, b, -1);
+            if (s < 0) return -1;
+            if (prev < 0) entry = s;
+            else re->nfa[prev].out = s;
+            prev = s;
+        }
+        a = compile(re, id, next);
+        if (a < 0) return -1;
+        re->nfa[prev].out = a;
+        return entry;
+    }
+    default: /* N_REP: min copies, then max - min optional ones or a loop */
+        if (n.max < 0) {
+            int loop = emit(re, S_SPLIT, -1, next, -1);
+            if (loop < 0) return -1;
+            a = compile(re, n.a, loop);
+            if (a < 0) return -1;
+            re->nfa[loop].out = a;
+            next = loop;
+        } else {
+            for (int k = n.min; k < n.max && next >= 0; k++) {
+                a = compile(re, n.a, next);
+                next = a < 0 ? -1 : emit(re, S_SPLIT, a, next, -1);
+            }
+        }
+        for (int k = 0; k < n.min && next >= 0; k++)
+            next = compile(re, n.a, next);
+        return next;
+    }
+}
+
+/*
+ * Splits the bytes into classes that no character set tells apart, so
+ * DFA rows need one entry per class instead of one per byte.
+ */
+static void make_classes(struct regex *re) {
+    uint16_t map[512];
+
+    memset(re->cls, 0, sizeof(re->cls));
+    re->cls['\n'] = 1;
+    re->ncls = 2;
+    for (size_t s = 0; s < re->nsets; s++) {
+        size_t n = 0;
+        for (size_t k = 0; k < 512; k++) map[k] = 0xffff;
+        for (unsigned b = 0; b < 256; b++) {
+            unsigned key = (unsigned)re->cls[b] * 2 +
+                           (unsigned)cset_has(&re->sets[s], b);
+            if (map[key] == 0xffff) map[key] = (uint16_t)n++;
+            re->cls[b] = map[key];
+        }
+        re->ncls = n;
+    }
+    for (unsigned b = 256; b-- > 0;) re->rep[re->cls[b]] = (unsigned char)b;
+}
+
+/* ---- closures ---- */
+
+struct closure {
+    int *list;
+    size_t len;
+    int *stack;
+    unsigned *mark;
+    unsigned gen;
+};
+
+/*
+ * Adds the states reachable from `s` without reading a byte. Line start
+ * assertions pass only when `bol` is set; line end assertions are kept
+ * in the set and resolved when the line ends, unless `eol` is set.
+ */
+static void closure_add(const struct regex *re, struct closure *c, int s,
+                        int bol, int eol) {
+    size_t sp = 0;
+    c->stack[sp++] = s;
+    while (sp > 0) {
+        s = c->stack[--sp];
+        if (c->mark[s] == c->gen) continue;
+        c->mark[s] = c->gen;
+        const struct nstate *st = &re->nfa[s];
+        switch (st->type) {
+        case S_SPLIT:
+            c->stack[sp++] = st->out1;
+            c->stack[sp++] = st->out;
+            break;
+        case S_EPS:
+            c->stack[sp++] = st->out;
+            break;
+        case S_BOL:
+            if (bol) c->stack[sp++] = st->out;
+            break;
+        case S_EOL:
+            if (eol) c->stack[sp++] = st->out;
+            else c->list[c->len++] = s;
+            break;
+        default:
+            c->list[c->len++] = s;
+            break;
+        }
+    }
+}
+
+static int closure_init(struct closure *c, size_t nnfa) {
+    c->list = malloc(nnfa * sizeof(*c->list));
+    c->stack = malloc((2 * nnfa + 1) * sizeof(*c->stack));
+    c->mark = calloc(nnfa, sizeof(*c->mark));
+    c->len = 0;
+    c->gen = 1;
+    return c->list && c->stack && c->mark ? 0 : -1;
+}
+
+static void closure_free(struct closure *c) {
+    free(c->list);
+    free(c->stack);
+    free(c->mark);
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static int *start_set(struct regex *re, struct closure *c, int bol,
+                      size_t *len) {
+    c->gen++;
+    c->len = 0;
+    closure_add(re, c, re->start, bol, 0);
+    qsort(c->list, c->len, sizeof(int), cmp_int);
+    int *set = malloc((c->len ? c->len : 1) * sizeof(*set));
+    if (set) memcpy(set, c->list, c->len * sizeof(*set));
+    *len = c->len;
+    return set;
+}
+
+struct regex *regex_compile(const char *const *pats, const size_t *lens,
+                            size_t n, const char **err) {
+    struct regex *re = calloc(1, sizeof(*re));
+    struct parser ps;
+    struct closure c;
+    struct lits lits;
+    int root = -1;
+
+    *err = "out of memory";
+    if (!re) return NULL;
+    memset(&ps, 0, sizeof(ps));
+    ps.re = re;
+    for (size_t k = 0; k < n; k++) {
+        ps.p = (const unsigned char *)pats[k];
+        ps.end = ps.p + lens[k];
+        int t = parse_alt(&ps, 0);
+        if (t >= 0 && ps.p < ps.end) {
+            ps.err = "unmatched )";
+            t = -1;
+        }
+        if (t < 0) {
+            *err = ps.err;
+            regex_free(re);
+            return NULL;
+        }
+        root = root < 0 ? t : binary(&ps, N_ALT, root, t);
+        if (root < 0) {
+            *err = ps.err;
+            regex_free(re);
+            return NULL;
+        }
+    }
+    if (root < 0) root = new_node(re, N_EMPTY);
+
+    int match = root < 0 ? -1 : emit(re, S_MATCH, -1, -1, -1);
+    re->start = root < 0 || match < 0 ? -1 : compile(re, root, match);
+    if (re->start < 0) {
+        *err = re->nnfa >= MAX_NFA ? "regular expression too big"
+                                   : "out of memory";
+        regex_free(re);
+        return NULL;
+    }
+    make_classes(re);
+
+    if (closure_init(&c, re->nnfa) < 0) {
+        closure_free(&c);
+        regex_free(re);
+        return NULL;
+    }
+    re->bol_set = start_set(re, &c, 1, &re->bol_len);
+    re->mid_set = start_set(re, &c, 0, &re->mid_len);
+    closure_free(&c);
+    if (re->mid_set) {
+        for (size_t k = 0; k < re->mid_len; k++) {
+            const struct nstate *st = &re->nfa[re->mid_set[k]];
+            if (st->type != S_CHAR) continue;
+            for (unsigned b = 0; b < 256; b++)
+                re->first[b] |= (unsigned char)cset_has(&re->sets[st->set], b);
+        }
+        re->first['\n'] = 1;
+    }
+
+    required(re, root, &lits);
+    /* literals are collected in runs of at most 255 bytes */
+    int len = exact_len(re, root);
+    re->exact = len > 0 && len <= 255 && lits.n > 0;
+    if (lits.n == 1) {
+        re->lit = lits.s[0];
+        re->lit_len = lits.len[0];
+        lits.n = 0;
+    } else if (lits.n > 1) {
+        re->lits = ac_build((const char *const *)lits.s, lits.len, lits.n);
+    }
+    lits_clear(&lits);
+
+    /* the parse tree is only needed while compiling */
+    free(re->nodes);
+    re->nodes = NULL;
+    re->nnodes = re->nodes_cap = 0;
+    if (!re->bol_set || !re->mid_set) {
+        regex_free(re);
+        return NULL;
+    }
+    return re;
+}
+
+void regex_free(struct regex *re) {
+    if (!re) return;
+    free(re->nodes);
+    free(re->sets);
+    free(re->nfa);
+    free(re->bol_set);
+    free(re->mid_set);
+    free(re->lit);
+    ac_free(re->lits);
+    free(re);
+}
+
+/* ---- lazy DFA ---- */
+
+/*
+ * D_IDLE marks the state in which no match is under way: it stays there
+ * on every byte that cannot start one.
+ */
+enum { D_ACCEPT = 1, D_ACCEPT_EOL = 2, D_DEAD = 4, D_BOL = 8, D_IDLE = 16 };
+
+/*
+ * Everything is allocated up front: DFA_STATES rows of transitions and a
+ * pool for the NFA state sets. When either runs out the cache is flushed
+ * and refilled from the current state, so searching never allocates.
+ */
+struct dfa {
+    const struct regex *re;
+    int *trans;                 /* DFA_STATES x ncls, -1 = not built */
+    unsigned char *flags;
+    size_t *set_off;
+    size_t *set_len;
+    uint32_t *hash;
+    size_t nstates;
+    int *pool;
+    size_t pool_len, pool_cap;
+    int *htab;                  /* open addressing, 2 x DFA_STATES */
+    struct closure c;
+    int bol;
+};
+
+static uint32_t set_hash(const int *set, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t k = 0; k < n; k++) h = (h ^ (uint32_t)set[k]) * 16777619u;
+    return h;
+}
+
+static void dfa_flush(struct dfa *d) {
+    d->nstates = 0;
+    d->pool_len = 0;
+    for (size_t k = 0; k < 2 * DFA_STATES; k++) d->htab[k] = -1;
+}
+
+/*
+ * Finds or adds the state for set[0..n), sorted; -1 when full. The state
+ * at the start of a line is kept apart from any other with the same set,
+ * since only there can a line end also be a line start.
+ */
+static int dfa_state(struct dfa *d, const int *set, size_t n, int bol) {
+    const struct regex *re = d->re;
+    uint32_t h = set_hash(set, n) ^ (uint32_t)bol;
+    size_t mask = 2 * DFA_STATES - 1, slot = h & mask;
+
+    for (; d->htab[slot] >= 0; slot = (slot + 1) & mask) {
+        int s = d->htab[slot];
+        if (d->hash[s] == h && d->set_len[s] == n &&
+            !(d->flags[s] & D_BOL) == !bol &&
+            memcmp(d->pool + d->set_off[s], set, n * sizeof(int)) == 0)
+            return s;
+    }
+    if (d->nstates == DFA_STATES || d->pool_cap - d->pool_len < n) return -1;
+
+    int s = (int)d->nstates++;
+    memcpy(d->pool + d->pool_len, set, n * sizeof(int));
+    d->set_off[s] = d->pool_len;
+    d->set_len[s] = n;
+    d->pool_len += n;
+    d->hash[s] = h;
+    d->htab[slot] = s;
+    for (size_t k = 0; k < re->ncls; k++)
+        d->trans[(size_t)s * re->ncls + k] = -1;
+
+    /* `set` may be the closure list, which the loop below reuses */
+    set = d->pool + d->set_off[s];
+    unsigned char f = (n == 0 ? D_DEAD : 0) | (bol ? D_BOL : 0);
+    if (!bol && n == re->mid_len &&
+        memcmp(set, re->mid_set, n * sizeof(int)) == 0)
+        f |= D_IDLE;
+    for (size_t k = 0; k < n; k++) {
+        const struct nstate *st = &re->nfa[set[k]];
+        if (st->type == S_MATCH) f |= D_ACCEPT;
+        if (st->type == S_EOL && !(f & D_ACCEPT_EOL)) {
+            /* does the line end here let this assertion reach a match? */
+            d->c.gen++;
+            d->c.len = 0;
+            closure_add(re, &d->c, st->out, bol, 1);
+            for (size_t i = 0; i < d->c.len; i++)
+                if (re->nfa[d->c.list[i]].type == S_MATCH) f |= D_ACCEPT_EOL;
+        }
+    }
+    if (f & D_ACCEPT) f |= D_ACCEPT_EOL;
+    d->flags[s] = f;
+    return s;
+}
+
+static int dfa_bol(struct dfa *d) {
+    int s = dfa_state(d, d->re->bol_set, d->re->bol_len, 1);
+    if (s < 0) {
+        dfa_flush(d);
+        s = dfa_state(d, d->re->bol_set, d->re->bol_len, 1);
+    }
+    return s;
+}
+
+/* Builds the transition of state `s` on byte class `cls`. */
+static int dfa_step(struct dfa *d, int s, size_t cls) {
+    const struct regex *re = d->re;
+    unsigned b = re->rep[cls];
+    const int *set = d->pool + d->set_off[s];
+    size_t n = d->set_len[s];
+    struct closure *c = &d->c;
+
+    c->gen++;
+    c->len = 0;
+    for (size_t k = 0; k < n; k++) {
+        const struct nstate *st = &re->nfa[set[k]];
+        if (st->type == S_CHAR && cset_has(&re->sets[st->set], b))
+            closure_add(re, c, st->out, 0, 0);
+    }
+    /* a match may start anywhere: the start state is always active */
+    for (size_t k = 0; k < re->mid_len; k++)
+        closure_add(re, c, re->mid_set[k], 0, 0);
+    qsort(c->list, c->len, sizeof(int), cmp_int);
+
+    int t = dfa_state(d, c->list, c->len, 0);
+    if (t >= 0) {
+        d->trans[(size_t)s * re->ncls + cls] = t;
+        return t;
+    }
+    /* cache full: start over with just the state we are moving to */
+    dfa_flush(d);
+    t = dfa_state(d, c->list, c->len, 0);
+    d->bol = dfa_bol(d);
+    return t;
+}
+
+struct dfa *dfa_new(const struct regex *re) {
+    struct dfa *d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    d->re = re;
+    d->trans = malloc((size_t)DFA_STATES * re->ncls * sizeof(*d->trans));
+    d->flags = malloc(DFA_STATES);
+    d->set_off = malloc(DFA_STATES * sizeof(*d->set_off));
+    d->set_len = malloc(DFA_STATES * sizeof(*d->set_len));
+    d->hash = malloc(DFA_STATES * sizeof(*d->hash));
+    d->htab = malloc(2 * DFA_STATES * sizeof(*d->htab));
+    /* room for at least two full sets, so a flush always makes progress */
+    d->pool_cap = re->nnfa * 2 > 65536 ? re->nnfa * 2 : 65536;
+    d->pool = malloc(d->pool_cap * sizeof(*d->pool));
+    if (!d->trans || !d->flags || !d->set_off || !d->set_len || !d->hash ||
+        !d->htab || !d->pool || closure_init(&d->c, re->nnfa) < 0) {
+        dfa_free(d);
+        return NULL;
+    }
+    dfa_flush(d);
+    d->bol = dfa_bol(d);
+    return d;
+}
+
+void dfa_free(struct dfa *d) {
+    if (!d) return;
+    free(d->trans);
+    free(d->flags);
+    free(d->set_off);
+    free(d->set_len);
+    free(d->hash);
+    free(d->htab);
+    free(d->pool);
+    closure_free(&d->c);
+    free(d);
+}
+
+/* Runs the DFA over whole lines in [p, end); see regex_find(). */
+static const char *dfa_scan(struct dfa *d, const char *hay, const char *end) {
+    const unsigned char *p = (const unsigned char *)hay;
+    const unsigned char *e = (const unsigned char *)end;
+    const uint16_t *cls = d->re->cls;
+    size_t ncls = d->re->ncls;
+    int s = d->bol;
+
+    if (p < e && (d->flags[s] & D_ACCEPT)) return hay;
+    while (p < e) {
+        /*
+         * The common case: a built transition to a state that neither
+         * matches nor is dead. Transitions on '\n' are never built, so
+         * line ends take the slow path too.
+         */
+        size_t c = cls[*p];
+        int t = d->trans[(size_t)s * ncls + c];
+        if (t >= 0 && !(d->flags[t] & (D_ACCEPT | D_DEAD | D_IDLE))) {
+            s = t;
+            p++;
+            continue;
+        }
+        if (*p == '\n') {
+            if (d->flags[s] & D_ACCEPT_EOL) return (const char *)p;
+            s = d->bol;
+            p++;
+            if (p < e && (d->flags[s] & D_ACCEPT)) return (const char *)p;
+            continue;
+        }
+        if (t < 0) t = dfa_step(d, s, c);
+        s = t;
+        if (d->flags[s] & D_ACCEPT) return (const char *)p;
+        p++;
+        if (d->flags[s] & D_DEAD) {
+            /* nothing can match before the next line */
+            p = memchr(p, '\n', (size_t)(e - p));
+            if (!p) return NULL;
+        } else if (d->flags[s] & D_IDLE) {
+            while (p < e && !d->re->first[*p]) p++;
+        }
+    }
+    if (p > (const unsigned char *)hay && p[-1] != '\n' &&
+        (d->flags[s] & D_ACCEPT_EOL))
+        return (const char *)p - 1;
+    return NULL;
+}
+
+const char *regex_find(struct dfa *d, const char *hay, size_t n) {
+    const struct regex *re = d->re;
+    const char *p = hay, *end = hay + n;
+
+    if (!re->lit && !re->lits) return dfa_scan(d, hay, end);
+
+    /* only lines holding a required literal can match */
+    while (p < end) {
+        const char *hit = re->lits ? ac_find(re->lits, p, (size_t)(end - p))
+                                   : search_find(p, (size_t)(end - p),
+                                                 re->lit, re->lit_len);
+        if (!hit) return NULL;
+        const char *start = hit;
+        while (start > p && start[-1] != '\n') start--;
+        const char *nl = memchr(hit, '\n', (size_t)(end - hit));
+        const char *stop = nl ? nl : end;
+        if (re->exact || dfa_scan(d, start, stop)) return hit;
+        p = nl ? nl + 1 : end;
+    }
+    return NULL;
+}
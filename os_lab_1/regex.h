@@ -0,0 +1,33 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <stddef.h>
+
+/*
+ * POSIX extended regular expressions over bytes, matched line by line.
+ * A compiled expression is read only and can be shared between threads;
+ * the DFA states built while searching live in a struct dfa, of which
+ * every thread needs its own.
+ */
+struct regex;
+struct dfa;
+
+/*
+ * Compiles the alternation of pats[i][0..lens[i]), i < n. On failure
+ * returns NULL and points *err at a message.
+ */
+struct regex *regex_compile(const char *const *pats, const size_t *lens,
+                            size_t n, const char **err);
+void regex_free(struct regex *re);
+
+/* Returns NULL when out of memory. */
+struct dfa *dfa_new(const struct regex *re);
+void dfa_free(struct dfa *d);
+
+/*
+ * hay[0..n) starts at the beginning of a line. Returns a pointer into the
+ * first line that matches, or NULL.
+ */
+const char *regex_find(struct dfa *d, const char *hay, size_t n);
+
+#endif
@@ -0,0 +1,165 @@
+#include "search.h"
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/*
+ * Substring search over a whole buffer. The SIMD kernels compare a block
+ * of candidate positions against the first and the last byte of the
+ * pattern at once and only run memcmp where both agree, which on real
+ * text rejects almost every position without looking at it twice.
+ */
+typedef const char *(*find_fn)(const char *, size_t, const char *, size_t);
+typedef size_t (*count_fn)(const char *, size_t, char);
+
+static const char *find_scalar(const char *hay, size_t n,
+                               const char *pat, size_t m) {
+    if (n < m) return NULL;
+    const char *end = hay + n - m + 1;
+    for (const char *p = hay; (p = memchr(p, pat[0], (size_t)(end - p))); p++) {
+        if (p[m - 1] == pat[m - 1] && memcmp(p, pat, m) == 0) return p;
+    }
+    return NULL;
+}
+
+static size_t count_scalar(const char *hay, size_t n, char c) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) k += hay[i] == c;
+    return k;
+}
+
+#ifdef HAVE_X86_SIMD
+
+static inline int ctz32(unsigned v) {
+    return __builtin_ctz(v);
+}
+
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *hay, size_t n,
+                             const char *pat, size_t m) {
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t k = i + (size_t)ctz32(mask);
+            if (memcmp(hay + k + 1, pat + 1, m - 2) == 0) return hay + k;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(hay + i, n - i, pat, m);
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *hay, size_t n,
+                             const char *pat, size_t m) {
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+    size_t i = 0;
+
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t k = i + (size_t)ctz32(mask);
+            if (memcmp(hay + k + 1, pat + 1, m - 2) == 0) return hay + k;
+            mask &= mask - 1;
+        }
+    }
+    return find_scalar(hay + i, n - i, pat, m);
+}
+
+/*
+ * Byte counters: compare results are -1 per equal byte, so subtracting
+ * them counts in 8-bit lanes; every 255 blocks the lanes are summed into
+ * 64-bit totals with SAD before they can overflow.
+ */
+__attribute__((target("sse2")))
+static size_t count_sse2(const char *hay, size_t n, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+
+    while (i + 16 <= n) {
+        __m128i acc = _mm_setzero_si128();
+        for (int k = 0; k < 255 && i + 16 <= n; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(hay + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, total);
+    return (size_t)(lanes[0] + lanes[1]) + count_scalar(hay + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t count_avx2(const char *hay, size_t n, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i + 32 <= n) {
+        __m256i acc = _mm256_setzero_si256();
+        for (int k = 0; k < 255 && i + 32 <= n; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(hay + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+        }
+        total = _mm256_add_epi64(total,
+                                 _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+           count_scalar(hay + i, n - i, c);
+}
+
+#endif
+
+static find_fn kernel = find_scalar;
+static count_fn counter = count_scalar;
+static const char *kernel_name = "scalar";
+
+void search_init(void) {
+#ifdef HAVE_X86_SIMD
+    /* cpu_supports reads CPUID and checks that the OS saves AVX state */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = find_avx2;
+        counter = count_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = find_sse2;
+        counter = count_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *search_find(const char *hay, size_t n, const char *pat, size_t m) {
+    if (m == 0) return hay;
+    if (n < m) return NULL;
+    /* one byte needs no second filter, and libc's memchr is vectorized */
+    if (m == 1) return memchr(hay, pat[0], n);
+    return kernel(hay, n, pat, m);
+}
+
+size_t search_count(const char *hay, size_t n, char c) {
+    return counter(hay, n, c);
+}
+
+const char *search_kernel_name(void) {
+    return kernel_name;
+}
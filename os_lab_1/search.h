@@ -0,0 +1,18 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/* Picks the fastest kernel for this CPU; call once before searching. */
+void search_init(void);
+
+/* First occurrence of pat[0..m) in hay[0..n), or NULL. */
+const char *search_find(const char *hay, size_t n, const char *pat, size_t m);
+
+/* Number of bytes equal to c in hay[0..n). */
+size_t search_count(const char *hay, size_t n, char c);
+
+/* Name of the kernel search_init() picked ("avx2", "sse2" or "scalar"). */
+const char *search_kernel_name(void);
+
+#endif